@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2024, Ilya Kurdyukov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY
+ * DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#ifndef ADPCM_H
+#define ADPCM_H
+
+#include <stdint.h>
+
+#if 1
+// uses unknown 4-bit ADPCM
+static uint8_t adpcm_value[256] = {
+	0xff, 0xff, 0xff, 0x00, 0x00, 0x02, 0x03, 0x05,
+	0xfe, 0xfe, 0xff, 0xfe, 0x00, 0x03, 0x08, 0x0a,
+	0xfd, 0xfd, 0xfe, 0xfd, 0xfd, 0xfe, 0xfd, 0x04,
+	0xfd, 0xfc, 0xfc, 0xfb, 0xfb, 0xfc, 0xff, 0x07,
+	0xfd, 0xfb, 0xfb, 0xfb, 0xfb, 0xfc, 0x00, 0x0a,
+	0xfc, 0xfb, 0xfa, 0xfa, 0xfb, 0xfc, 0xff, 0x0b,
+	0xfb, 0xfb, 0xfb, 0xfb, 0xfb, 0xfc, 0xff, 0x0c,
+	0xfa, 0xfa, 0xfa, 0xfa, 0xfa, 0xfc, 0x01, 0x11,
+	0xf9, 0xf9, 0xfa, 0xfa, 0xfa, 0xfc, 0x01, 0x13,
+	0xf9, 0xf9, 0xf8, 0xf8, 0xf8, 0xfa, 0xff, 0x11,
+	0xf9, 0xf9, 0xf7, 0xf6, 0xf6, 0xf7, 0xfd, 0x17,
+	0xf8, 0xf8, 0xf8, 0xf6, 0xf6, 0xf8, 0x00, 0x1e,
+	0xf7, 0xf7, 0xf7, 0xf6, 0xf7, 0xf9, 0x06, 0x38,
+	0xf6, 0xf6, 0xf6, 0xf5, 0xf6, 0xfb, 0x0a, 0x33,
+	0xf6, 0xf7, 0xf6, 0xf5, 0xf6, 0xfa, 0x07, 0x2e,
+	0xf6, 0xf7, 0xf6, 0xf5, 0xf5, 0xf8, 0x04, 0x2f,
+	0xf5, 0xf6, 0xf6, 0xf6, 0xf5, 0xf8, 0x01, 0x28,
+	0xf6, 0xf6, 0xf5, 0xf5, 0xf5, 0xf7, 0x00, 0x21,
+	0xf6, 0xf7, 0xf7, 0xf7, 0xf8, 0xfb, 0x04, 0x1c,
+	0xf6, 0xf6, 0xf7, 0xf7, 0xf8, 0xfb, 0x02, 0x15,
+	0xf6, 0xf7, 0xf8, 0xf8, 0xfa, 0xfd, 0x04, 0x18,
+	0xf6, 0xf8, 0xfa, 0xfa, 0xfa, 0xff, 0x05, 0x1e,
+	0xf6, 0xf7, 0xfc, 0xfd, 0xff, 0x03, 0x08, 0x19,
+	0xf7, 0xfa, 0x00, 0x00, 0x04, 0x07, 0x0a, 0x13,
+	0xf8, 0xfd, 0x03, 0x08, 0x0c, 0x0d, 0x13, 0x1c,
+	0xf8, 0x00, 0x08, 0x0c, 0x0d, 0x13, 0x1a, 0x1c,
+	0xf8, 0x04, 0x0a, 0x10, 0x10, 0x0f, 0x16, 0x17,
+	0xfc, 0x04, 0x0f, 0x13, 0x18, 0x19, 0x19, 0x10,
+	0xfd, 0x08, 0x12, 0x1f, 0x1f, 0x25, 0x21, 0x0d,
+	0xfd, 0x0a, 0x10, 0x1e, 0x23, 0x2a, 0x1b, 0x09,
+	0xfe, 0x0a, 0x0e, 0x25, 0x1f, 0x29, 0x25, 0x06,
+	0xfe, 0x0d, 0x19, 0x33, 0x55, 0x3e, 0x1e, 0xfe };
+
+static uint8_t adpcm_next[256];
+
+typedef struct { uint8_t idx; } adpcm_status_t;
+
+static void adpcm_init(adpcm_status_t *adpcm) {
+	int i;
+	adpcm->idx = 0;
+	if (adpcm_next[7]) return;
+	for (i = 0; i < 256; i++) {
+		int a = i >> 3;
+#define X(thr) ((a + (32 - thr)) >> 5)
+		switch (i & 7) {
+		case 0: a -= 1 + X(20) + X(30); break;
+		case 1: a -= 1 + X(26) + X(30); break;
+		case 2: a -= 1 + X(28); break;
+		case 3: a -= X(27) + X(29); break;
+		case 7: a += 4 + X(11) + X(12); break;
+#undef X
+		default: a++;
+		}
+		a = a < 0 ? 0 : a > 31 ? 31 : a;
+		adpcm_next[i] = a * 8;
+		adpcm_value[i] += ((i & 7) + 1) * ((i >> 3) + 1);
+	}
+}
+
+static int adpcm_decode(adpcm_status_t *adpcm, unsigned x) {
+	unsigned a = (x & 7) | adpcm->idx;
+	adpcm->idx = adpcm_next[a];
+	a = adpcm_value[a];
+	return (x & 8 ? -a : a) << 6;
+}
+#else
+typedef struct { uint8_t dummy; } adpcm_status_t;
+static void adpcm_init(adpcm_status_t *adpcm) {}
+// this rough guess sounds close
+static int adpcm_decode(adpcm_status_t *adpcm, unsigned x) {
+	x = x & 8 ? 7 - x : x;
+	return x << 11;
+}
+#endif
+
+#endif
@@ -0,0 +1,465 @@
+/*
+ * Copyright (c) 2024, Ilya Kurdyukov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY
+ * DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/* Finds every overlay reachable from the entry points and */
+/* prints the call graph with the BIOS calls of each overlay. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "op_mod.h"
+
+#define ERR_EXIT(...) do { \
+	fprintf(stderr, __VA_ARGS__); exit(1); \
+} while (0)
+
+#define READ16(p) ((p)[0] | (p)[1] << 8)
+#define READ24(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16)
+
+static uint8_t* loadfile(const char *fn, size_t *num, size_t nmax) {
+	size_t n, j = 0; uint8_t *buf = 0;
+	FILE *fi = fopen(fn, "rb");
+	if (fi) {
+		fseek(fi, 0, SEEK_END);
+		n = ftell(fi);
+		if (n <= nmax) {
+			fseek(fi, 0, SEEK_SET);
+			if (n) {
+				buf = (uint8_t*)malloc(n);
+				if (buf) j = fread(buf, 1, n, fi);
+			}
+		}
+		fclose(fi);
+	}
+	if (num) *num = j;
+	return buf;
+}
+
+#define X(m, cmt) MOD_##m,
+#define S(m, cmt) MOD_##m | 0x80,
+static const uint8_t op_mod[256] = { OP_TABLE(X, S) };
+#undef X
+#undef S
+
+#define X(m, cmt) cmt + 5,
+static const char * const op_name[256] = { OP_TABLE(X, X) };
+#undef X
+
+enum { REG_A = 1, REG_X = 2, REG_Y = 4, MEM_W = 8, OP_STOP = 16, OP_BAD = 32 };
+static uint8_t op_info[256], op_len[256];
+
+static int name_in(const char *name, const char *list) {
+	for (; *list; list += 4)
+		if (!memcmp(name, list, 3)) return 1;
+	return 0;
+}
+
+static void op_init(void) {
+	static const uint8_t len[MOD_LAST] = {
+		[MOD_NUL] = 1, [MOD_IMM] = 2, [MOD_ACC] = 1,
+		[MOD_X] = 1, [MOD_Y] = 1, [MOD_Z] = 2, [MOD_ZX] = 2,
+		[MOD_ZY] = 2, [MOD_ZI] = 2, [MOD_ZXI] = 2, [MOD_ZIY] = 2,
+		[MOD_A] = 3, [MOD_AX] = 3, [MOD_AY] = 3, [MOD_R] = 2 };
+	unsigned op;
+	for (op = 0; op < 256; op++) {
+		const char *name = op_name[op];
+		unsigned m = op_mod[op] & 0x7f, f = 0;
+		op_len[op] = len[m];
+		if ((op & 0xf) == 0xf) op_len[op] = 3; // BBR/BBS
+		if (op == 0x20 || op == 0x4c) op_len[op] = 3; // JSR/JMP
+		if (name_in(name, "LDA PLA TXA TYA ADC SBC AND ORA EOR ")) f |= REG_A;
+		if (name_in(name, "LDX PLX TAX TSX INX DEX ")) f |= REG_X;
+		if (name_in(name, "LDY PLY TAY INY DEY ")) f |= REG_Y;
+		if (name_in(name, "ASL LSR ROL ROR INC DEC TSB TRB RMB SMB ")) {
+			if (m == MOD_ACC) f |= REG_A;
+			else f |= MEM_W;
+		}
+		if (op_mod[op] & 0x80) f |= MEM_W;
+		if (name_in(name, "RTS RTI BRA JMP STP BRK ")) f |= OP_STOP;
+		if (!strcmp(name, "---")) f |= OP_BAD;
+		op_info[op] = f;
+	}
+}
+
+typedef struct {
+	unsigned addr, size, tail, count;
+} call_t;
+
+typedef struct {
+	unsigned addr, size;
+	unsigned insns, code, unresolved, bad;
+	unsigned bios[0x30 >> 1], bios_unknown;
+	call_t *calls; unsigned ncalls;
+	char *text; size_t text_size, text_max;
+	const char *err;
+} ovl_t;
+
+static void ovl_printf(ovl_t *o, const char *fmt, ...) {
+	va_list va; int n;
+	for (;;) {
+		size_t left = o->text_max - o->text_size;
+		va_start(va, fmt);
+		n = vsnprintf(o->text + o->text_size, left, fmt, va);
+		va_end(va);
+		if (n < 0) ERR_EXIT("vsnprintf failed\n");
+		if ((size_t)n < left) break;
+		o->text_max = o->text_max * 2 + n + 256;
+		o->text = realloc(o->text, o->text_max);
+		if (!o->text) ERR_EXIT("malloc failed\n");
+	}
+	o->text_size += n;
+}
+
+static void ovl_call(ovl_t *o, unsigned addr, unsigned size, int tail) {
+	unsigned i;
+	for (i = 0; i < o->ncalls; i++) {
+		call_t *c = &o->calls[i];
+		if (c->addr == addr && c->size == size && c->tail == (unsigned)tail) {
+			c->count++;
+			return;
+		}
+	}
+	if (!(o->ncalls & (o->ncalls - 1))) {
+		o->calls = realloc(o->calls, (o->ncalls ? o->ncalls * 2 : 1) * sizeof(*o->calls));
+		if (!o->calls) ERR_EXIT("malloc failed\n");
+	}
+	o->calls[o->ncalls].addr = addr;
+	o->calls[o->ncalls].size = size;
+	o->calls[o->ncalls].tail = tail;
+	o->calls[o->ncalls++].count = 1;
+}
+
+#define FRAME_MAX 0x500
+enum { F_CODE = 1, F_LABEL = 2 };
+
+static void disasm_ovl(ovl_t *o, const uint8_t *rom, size_t rom_size, int listing) {
+	const uint8_t *code = rom + o->addr;
+	unsigned n = o->size, sp = 0, off, i;
+	unsigned stack[FRAME_MAX];
+	uint8_t fl[FRAME_MAX + 1];
+	int a, x, y, zp[5], prev_stop;
+
+	if (n > FRAME_MAX) { o->err = "too big"; return; }
+	if (rom_size < o->addr + n) { o->err = "outside the ROM"; return; }
+
+	/* follows the branches from the entry at 0x300 */
+	memset(fl, 0, sizeof(fl));
+	stack[sp++] = 0;
+	fl[0] = F_LABEL;
+	while (sp) {
+		off = stack[--sp];
+		while (off < n && !(fl[off] & F_CODE)) {
+			unsigned op = code[off], len = op_len[op], t = ~0u;
+			if (op_info[op] & OP_BAD || off + len > n) { o->bad++; break; }
+			fl[off] |= F_CODE;
+			if ((op_mod[op] & 0x7f) == MOD_R)
+				t = off + 2 + (int8_t)code[off + 1];
+			else if ((op & 0xf) == 0xf)
+				t = off + 3 + (int8_t)code[off + 2];
+			else if (op == 0x20 || op == 0x4c)
+				t = READ16(code + off + 1) - 0x300;
+			if (t < n) {
+				fl[t] |= F_LABEL;
+				if (!(fl[t] & F_CODE) && sp < FRAME_MAX) stack[sp++] = t;
+			}
+			if (op_info[op] & OP_STOP) break;
+			off += len;
+		}
+	}
+
+	/* Propagates the constants inside the basic blocks to find */
+	/* the call targets in 0x80-0x84 and the BIOS call ids in X. */
+	a = x = y = -1; prev_stop = 1;
+	for (i = 0; i < 5; i++) zp[i] = -1;
+	for (off = 0; off < n; ) {
+		unsigned op, len, f, m, arg, abs;
+		if (!(fl[off] & F_CODE)) { off++; prev_stop = 1; continue; }
+		if (prev_stop || fl[off] & F_LABEL) {
+			a = x = y = -1;
+			for (i = 0; i < 5; i++) zp[i] = -1;
+		}
+		op = code[off]; len = op_len[op]; f = op_info[op];
+		m = op_mod[op] & 0x7f;
+		arg = len > 1 ? code[off + 1] : 0;
+		abs = len > 2 ? (unsigned)READ16(code + off + 1) : arg;
+		o->insns++;
+		o->code += len;
+
+		if (listing) {
+			ovl_printf(o, "%06x %04x: ", o->addr + off, 0x300 + off);
+			for (i = 0; i < 3; i++)
+				if (i < len) ovl_printf(o, "%02x ", code[off + i]);
+				else ovl_printf(o, "   ");
+			ovl_printf(o, "%c%s", fl[off] & F_LABEL ? '>' : ' ', op_name[op]);
+			if ((op & 0xf) == 0xf)
+				ovl_printf(o, " $%02x,$%04x", arg, 0x300 + off + 3 + (int8_t)code[off + 2]);
+			else if (op == 0x20 || op == 0x4c) ovl_printf(o, " $%04x", abs);
+			else if (op == 0x6c) ovl_printf(o, " ($%04x)", abs);
+			else if (op == 0x7c) ovl_printf(o, " ($%04x,X)", abs);
+			else switch (m) {
+			case MOD_IMM: ovl_printf(o, " #$%02x", arg); break;
+			case MOD_ACC: if ((op & 0xf) == 0xa) ovl_printf(o, " A"); break;
+			case MOD_Z: ovl_printf(o, " $%02x", arg); break;
+			case MOD_ZX: ovl_printf(o, " $%02x,X", arg); break;
+			case MOD_ZY: ovl_printf(o, " $%02x,Y", arg); break;
+			case MOD_ZI: ovl_printf(o, " ($%02x)", arg); break;
+			case MOD_ZXI: ovl_printf(o, " ($%02x,X)", arg); break;
+			case MOD_ZIY: ovl_printf(o, " ($%02x),Y", arg); break;
+			case MOD_A: ovl_printf(o, " $%04x", abs); break;
+			case MOD_AX: ovl_printf(o, " $%04x,X", abs); break;
+			case MOD_AY: ovl_printf(o, " $%04x,Y", abs); break;
+			case MOD_R: ovl_printf(o, " $%04x", 0x300 + off + 2 + (int8_t)arg); break;
+			}
+		}
+
+		if ((op == 0x20 || op == 0x4c) && (abs == 0x60de || abs == 0x6052)) {
+			if (zp[0] < 0 || zp[1] < 0 || zp[2] < 0 || zp[3] < 0 || zp[4] < 0) {
+				o->unresolved++;
+				if (listing) ovl_printf(o, "\t; ROM call, unknown target");
+			} else {
+				unsigned addr = zp[0] | zp[1] << 8 | zp[2] << 16;
+				unsigned size = (zp[3] | zp[4] << 8) << 1;
+				ovl_call(o, addr, size, abs == 0x6052);
+				if (listing) ovl_printf(o, "\t; ROM call 0x%06x, 0x%x", addr, size);
+			}
+		} else if (op == 0x20 && abs == 0x6000) {
+			if (x < 0 || x >= 0x30 || x & 1) {
+				o->bios_unknown++;
+				if (listing) ovl_printf(o, "\t; BIOS call, unknown");
+			} else {
+				o->bios[x >> 1]++;
+				if (listing) ovl_printf(o, "\t; BIOS 0x%02x %s", x,
+						bios_names[x >> 1] ? bios_names[x >> 1] : "");
+			}
+		}
+		if (listing) ovl_printf(o, "\n");
+
+		switch (op) {
+		case 0xa9: a = arg; break; // LDA #
+		case 0xa2: x = arg; break; // LDX #
+		case 0xa0: y = arg; break; // LDY #
+		case 0xaa: x = a; break; // TAX
+		case 0xa8: y = a; break; // TAY
+		case 0x8a: a = x; break; // TXA
+		case 0x98: a = y; break; // TYA
+		case 0xe8: if (x >= 0) x = (x + 1) & 0xff; break; // INX
+		case 0xca: if (x >= 0) x = (x - 1) & 0xff; break; // DEX
+		case 0xc8: if (y >= 0) y = (y + 1) & 0xff; break; // INY
+		case 0x88: if (y >= 0) y = (y - 1) & 0xff; break; // DEY
+		case 0x85: case 0x86: case 0x84: case 0x64: // STA/STX/STY/STZ zp
+			if (arg - 0x80 < 5)
+				zp[arg - 0x80] = op == 0x85 ? a : op == 0x86 ? x : op == 0x84 ? y : 0;
+			break;
+		case 0x20: // JSR, the callee can change anything
+			a = x = y = -1;
+			for (i = 0; i < 5; i++) zp[i] = -1;
+			break;
+		default:
+			if (f & REG_A) a = -1;
+			if (f & REG_X) x = -1;
+			if (f & REG_Y) y = -1;
+			if (f & MEM_W) {
+				if (m == MOD_Z || m == MOD_A) {
+					if (abs - 0x80 < 5) zp[abs - 0x80] = -1;
+				} else for (i = 0; i < 5; i++) zp[i] = -1;
+			}
+		}
+		prev_stop = f & OP_STOP;
+		off += len;
+	}
+}
+
+typedef struct {
+	const uint8_t *rom; size_t rom_size;
+	ovl_t *ovl; unsigned first, last, next;
+	int listing;
+} job_t;
+
+static void* disasm_thread(void *arg) {
+	job_t *job = arg;
+	for (;;) {
+		unsigned i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		if (job->first + i >= job->last) break;
+		disasm_ovl(&job->ovl[job->first + i], job->rom, job->rom_size, job->listing);
+	}
+	return NULL;
+}
+
+/* The same address with another size is another overlay. */
+typedef struct {
+	ovl_t *ovl; unsigned count, max;
+	unsigned *hash; unsigned hash_size;
+} ovl_list_t;
+
+static unsigned ovl_hash(unsigned addr, unsigned size) {
+	return (addr * 0x9e3779b1u) ^ (size * 0x85ebca6bu);
+}
+
+static unsigned ovl_add(ovl_list_t *l, unsigned addr, unsigned size) {
+	unsigned i, h, mask = l->hash_size - 1;
+	if (l->count * 2 >= l->hash_size) {
+		unsigned *old = l->hash, old_size = l->hash_size;
+		l->hash_size = old_size ? old_size * 2 : 256;
+		l->hash = malloc(l->hash_size * sizeof(*l->hash));
+		if (!l->hash) ERR_EXIT("malloc failed\n");
+		memset(l->hash, -1, l->hash_size * sizeof(*l->hash));
+		mask = l->hash_size - 1;
+		for (i = 0; i < old_size; i++) {
+			unsigned k = old[i];
+			if (k == ~0u) continue;
+			h = ovl_hash(l->ovl[k].addr, l->ovl[k].size) & mask;
+			while (l->hash[h] != ~0u) h = (h + 1) & mask;
+			l->hash[h] = k;
+		}
+		free(old);
+	}
+	h = ovl_hash(addr, size) & mask;
+	for (; (i = l->hash[h]) != ~0u; h = (h + 1) & mask)
+		if (l->ovl[i].addr == addr && l->ovl[i].size == size) return i;
+	if (l->count == l->max) {
+		l->max = l->max ? l->max * 2 : 256;
+		l->ovl = realloc(l->ovl, l->max * sizeof(*l->ovl));
+		if (!l->ovl) ERR_EXIT("malloc failed\n");
+	}
+	i = l->count++;
+	memset(&l->ovl[i], 0, sizeof(*l->ovl));
+	l->ovl[i].addr = addr;
+	l->ovl[i].size = size;
+	return l->hash[h] = i;
+}
+
+int main(int argc, char **argv) {
+	size_t rom_size = 0; uint8_t *rom;
+	unsigned i, j, key, first = 0;
+	unsigned total_code = 0, total_unresolved = 0;
+	unsigned bios[0x30 >> 1] = { 0 }, bios_unknown = 0;
+	int nthreads = 1, listing = 0;
+	ovl_list_t list = { NULL, 0, 0, NULL, 0 };
+	pthread_t *threads;
+	job_t job;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-j")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			nthreads = atoi(argv[2]);
+			if (nthreads < 1) nthreads = 1;
+			if (nthreads > 256) nthreads = 256;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-d")) {
+			listing = 1;
+			argc -= 1; argv += 1;
+		} else ERR_EXIT("unknown option\n");
+	}
+
+	if (argc < 2) {
+		printf("Usage: toumapet-disasm [-j threads] [-d] flash.bin\n");
+		return 0;
+	}
+
+	rom = loadfile(argv[1], &rom_size, 8 << 20);
+	if (!rom) ERR_EXIT("loading ROM failed\n");
+	if (rom_size < 0x10000) ERR_EXIT("ROM is too small\n");
+	key = rom[0x23] ^ 't';
+	for (i = 0; i < 4; i++)
+		if ((rom[0x23 + i] ^ key) != (unsigned)"tony"[i])
+			ERR_EXIT("ROM magic doesn't match\n");
+	for (i = 0; i < rom_size; i++) rom[i] ^= key;
+
+	op_init();
+	// the init and the frame entries, the same as in the emulator
+	ovl_add(&list, READ16(rom + 3), READ16(rom + 3 + 2) << 1);
+	ovl_add(&list, READ16(rom + 0x1b), READ16(rom + 0x1b + 2) << 1);
+
+	threads = malloc(nthreads * sizeof(*threads));
+	if (!threads) ERR_EXIT("malloc failed\n");
+	job.rom = rom;
+	job.rom_size = rom_size;
+	job.listing = listing;
+
+	/* Each pass disassembles the overlays found by the previous one. */
+	while (first < list.count) {
+		unsigned last = list.count, n = last - first;
+		int k, nt = (unsigned)nthreads < n ? nthreads : (int)n;
+		job.ovl = list.ovl;
+		job.first = first;
+		job.last = last;
+		job.next = 0;
+		if (nt <= 1) disasm_thread(&job);
+		else {
+			for (k = 0; k < nt; k++)
+				if (pthread_create(&threads[k], NULL, disasm_thread, &job))
+					ERR_EXIT("pthread_create failed\n");
+			for (k = 0; k < nt; k++)
+				pthread_join(threads[k], NULL);
+		}
+		// in order, so the numbering doesn't depend on the threads
+		for (i = first; i < last; i++)
+			for (j = 0; j < list.ovl[i].ncalls; j++) {
+				call_t *c = &list.ovl[i].calls[j];
+				ovl_add(&list, c->addr, c->size);
+			}
+		first = last;
+	}
+
+	for (i = 0; i < list.count; i++) {
+		ovl_t *o = &list.ovl[i];
+		printf("ovl%u 0x%06x 0x%x", i, o->addr, o->size);
+		if (o->err) {
+			printf(" error: %s\n", o->err);
+			continue;
+		}
+		printf(" insns %u code %u", o->insns, o->code);
+		if (o->bad) printf(" bad %u", o->bad);
+		if (o->unresolved) printf(" unresolved %u", o->unresolved);
+		printf("\n");
+		for (j = 0; j < o->ncalls; j++) {
+			call_t *c = &o->calls[j];
+			printf("  %s ovl%u", c->tail ? "jump" : "call", ovl_add(&list, c->addr, c->size));
+			if (c->count > 1) printf(" x%u", c->count);
+			printf("\n");
+		}
+		for (j = 0; j < 0x30 >> 1; j++) {
+			if (!o->bios[j]) continue;
+			printf("  bios 0x%02x %s", j << 1, bios_names[j] ? bios_names[j] : "?");
+			if (o->bios[j] > 1) printf(" x%u", o->bios[j]);
+			printf("\n");
+			bios[j] += o->bios[j];
+		}
+		if (o->bios_unknown) printf("  bios unknown x%u\n", o->bios_unknown);
+		if (o->text) fwrite(o->text, 1, o->text_size, stdout);
+		total_code += o->code;
+		total_unresolved += o->unresolved;
+		bios_unknown += o->bios_unknown;
+		free(o->text);
+		free(o->calls);
+	}
+
+	printf("overlays: %u, code: %u bytes, unresolved calls: %u\n",
+			list.count, total_code, total_unresolved);
+	for (j = 0; j < 0x30 >> 1; j++)
+		if (bios[j]) printf("bios 0x%02x %s: %u\n", j << 1,
+				bios_names[j] ? bios_names[j] : "?", bios[j]);
+	if (bios_unknown) printf("bios unknown: %u\n", bios_unknown);
+
+	free(threads);
+	free(list.ovl);
+	free(list.hash);
+	free(rom);
+	return 0;
+}
@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2024, Ilya Kurdyukov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY
+ * DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/* Times the emulator kernels in isolation on the resources of a ROM. */
+
+#define main toumapet_main
+#include "toumapet.c"
+#undef main
+#include "adpcm.h"
+#include <math.h>
+
+#define BENCH_WARMUP 3
+#define BENCH_REPS 15
+#define BENCH_MIN_US 20000
+#define RES_MAX 4096
+
+typedef struct {
+	sysctx_t *sys;
+	cpu_state_t *cpu;
+	unsigned *list, count;
+	int flip, blend, alpha;
+} bench_t;
+
+/* returns the number of processed units */
+typedef uint64_t kernel_t(bench_t *b);
+
+static const char *bench_filter;
+
+static int cmp_double(const void *a, const void *b) {
+	double x = *(const double*)a, y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench_run(bench_t *b, const char *name, const char *unit, kernel_t *fn) {
+	sysctx_t *sys = b->sys;
+	double res[BENCH_REPS], sum = 0, dev = 0, avg;
+	unsigned i, k, iters = 1;
+	uint64_t t, n;
+
+	if (bench_filter && !strstr(name, bench_filter)) return;
+	if (!fn(b)) {
+		printf("%-24s (no data)\n", name);
+		return;
+	}
+	// finds the number of iterations for a long enough measurement
+	for (;;) {
+		t = sys_time_us(sys);
+		for (k = 0; k < iters; k++) fn(b);
+		t = sys_time_us(sys) - t;
+		if (t >= BENCH_MIN_US || iters >= 1u << 24) break;
+		iters *= 2;
+	}
+	for (i = 0; i < BENCH_WARMUP; i++)
+		for (k = 0; k < iters; k++) fn(b);
+
+	for (i = 0; i < BENCH_REPS; i++) {
+		t = sys_time_us(sys); n = 0;
+		for (k = 0; k < iters; k++) n += fn(b);
+		t = sys_time_us(sys) - t;
+		sum += res[i] = t * 1e3 / n;
+	}
+	avg = sum / BENCH_REPS;
+	for (i = 0; i < BENCH_REPS; i++)
+		dev += (res[i] - avg) * (res[i] - avg);
+	dev = sqrt(dev / BENCH_REPS);
+	qsort(res, BENCH_REPS, sizeof(double), cmp_double);
+	printf("%-24s %-5s %9.3f %9.3f %9.3f %6.2f%%\n", name, unit,
+			res[0], res[BENCH_REPS / 2], avg, dev * 100 / avg);
+}
+
+static uint64_t k_draw_image(bench_t *b) {
+	sysctx_t *sys = b->sys;
+	unsigned i;
+	sys->pixels_count = 0;
+	for (i = 0; i < b->count; i++)
+		draw_image(sys, 0, 0, get_image(sys, b->list[i]),
+				b->flip, b->blend, b->alpha);
+	return sys->pixels_count;
+}
+
+static uint64_t k_decode_line(bench_t *b) {
+	sysctx_t *sys = b->sys;
+	uint8_t buf[256];
+	unsigned i, n = 0;
+	for (i = 0; i < b->count; i++) {
+		uint8_t *src = sys->rom + get_image(sys, b->list[i]);
+		image_dec_t img;
+		img.src = src + 4; img.w = src[0]; img.h = src[2];
+		img.flip = b->flip; img.x_skip = 0;
+		img.end = sys->rom + sys->rom_size;
+		skip_lines(&img, 0);
+		n += img.w * img.h;
+		do decode_line(&img, buf, img.w, 0); while (--img.h);
+	}
+	return n;
+}
+
+/* the images collide, so it's measured per call */
+static uint64_t k_intersect(bench_t *b) {
+	sysctx_t *sys = b->sys; cpu_state_t *s = b->cpu;
+	unsigned i;
+	memset(s->mem + 0x100, 0, 10);
+	for (i = 0; i < b->count; i++) {
+		WRITE16(s->mem + 0x102, b->list[i]);
+		WRITE16(s->mem + 0x107, b->list[(i + 1) % b->count]);
+		bios_10(sys, s);
+	}
+	return b->count;
+}
+
+static uint64_t k_draw_char(bench_t *b) {
+	sysctx_t *sys = b->sys;
+	unsigned i;
+	sys->pixels_count = 0;
+	for (i = 0x20; i < 0x80; i++)
+		draw_char(sys, (i & 15) * 8, (i >> 4 & 7) * 16, i, 0xff, b->alpha);
+	return sys->pixels_count;
+}
+
+static uint64_t k_update(bench_t *b) {
+	sysctx_t *sys = b->sys;
+	sys_update(sys);
+	return SCREEN_W * sys->screen_h * sys->zoom * sys->zoom;
+}
+
+static void port_write(sysctx_t *sys, cpu_state_t *s, unsigned o, unsigned t) {
+	s->mem[o] = t;
+	if (o == 0x02) flash_emu(sys, s);
+	else if (o == 0x12) sys->flash.state = t ? FLASH_OFF : FLASH_READY;
+}
+
+/* each bit is sent twice with the clock in bit 0 and the data in bit 2 */
+static void flash_send(sysctx_t *sys, cpu_state_t *s, const uint8_t *buf, unsigned n) {
+	unsigned i, j;
+	port_write(sys, s, 0x12, 0);
+	port_write(sys, s, 0x02, 0);
+	for (i = 0; i < n; i++)
+		for (j = 8; j--;) {
+			unsigned a = (buf[i] >> j & 1) << 2;
+			port_write(sys, s, 0x02, a | 2);
+			port_write(sys, s, 0x02, a | 3);
+		}
+	port_write(sys, s, 0x02, 8);
+	port_write(sys, s, 0x12, 1);
+}
+
+static uint64_t k_flash(bench_t *b) {
+	sysctx_t *sys = b->sys; cpu_state_t *s = b->cpu;
+	uint8_t buf[4 + 256];
+	unsigned addr = sys->save_offs + 0x1000;
+	buf[0] = 0x06; /* Write Enable */
+	flash_send(sys, s, buf, 1);
+	buf[0] = 0x02; /* Page Program */
+	buf[1] = addr >> 16; buf[2] = addr >> 8; buf[3] = addr;
+	memset(buf + 4, 0xff, 256);
+	flash_send(sys, s, buf, 4 + 256);
+	return 256;
+}
+
+static uint64_t k_adpcm(bench_t *b) {
+	sysctx_t *sys = b->sys;
+	unsigned i, j, n = 0, res_tab = READ24(sys->rom);
+	int sum = 0;
+	for (i = 0; i < b->count; i++) {
+		unsigned id = b->list[i];
+		unsigned addr = READ24(sys->rom + res_tab + id * 3);
+		unsigned next = READ24(sys->rom + res_tab + id * 3 + 3);
+		adpcm_status_t adpcm;
+		if (next == 0xffffff) next = res_tab;
+		adpcm_init(&adpcm);
+		for (j = addr + 1; j < next; j++) {
+			int a = sys->rom[j];
+			sum += adpcm_decode(&adpcm, a & 15);
+			sum += adpcm_decode(&adpcm, a >> 4);
+		}
+		n += next - addr - 1;
+	}
+	// keeps the result alive
+	__asm__ __volatile__("" :: "r"(sum));
+	return n;
+}
+
+/* two passes to leave the ROM unchanged */
+static uint64_t k_xor(bench_t *b) {
+	sysctx_t *sys = b->sys;
+	rom_xor(sys->rom, sys->rom_size, b->blend);
+	rom_xor(sys->rom, sys->rom_size, b->blend);
+	return sys->rom_size * 2;
+}
+
+int main(int argc, char **argv) {
+	static cpu_state_t cpu;
+	static sysctx_t sys;
+	static unsigned rle[RES_MAX], bits[RES_MAX], sound[RES_MAX];
+	unsigned nrle = 0, nbits = 0, nsound = 0;
+	unsigned i, res_tab;
+	uint8_t *rom; size_t rom_size;
+	bench_t b;
+	char name[64];
+
+	if (argc < 2) {
+		printf("Usage: kbench rom.bin [filter]\n");
+		return 1;
+	}
+	if (argc > 2) bench_filter = argv[2];
+
+	rom = loadfile(argv[1], &rom_size, 8 << 20);
+	if (!rom) ERR_EXIT("can't load ROM file\n");
+	if (rom_size != 2 << 20 && rom_size != 4 << 20 && rom_size != 8 << 20)
+		ERR_EXIT("unexpected ROM size\n");
+	sys.screen_h = rom_size == 8 << 20 ? 160 : 128;
+	sys.save_offs = rom_size - 0x10000;
+	sys.rom = rom;
+	sys.rom_size = rom_size;
+	sys.headless = 1;
+	sys.zoom = 1;
+	check_rom(&sys);
+	sys_init(&sys);
+
+	// the same detection as in resextract
+	res_tab = READ24(rom);
+	for (i = 0; i < RES_MAX && res_tab + i * 3 + 6 <= rom_size; i++) {
+		unsigned addr = READ24(rom + res_tab + i * 3);
+		unsigned next = READ24(rom + res_tab + i * 3 + 3);
+		unsigned res_size;
+		if (addr == 0xffffff) break;
+		if (next == 0xffffff) next = res_tab;
+		if (addr >= next || next > rom_size) break;
+		res_size = next - addr;
+		if (res_size < 4) continue;
+		if (rom[addr + 3] == 0x80 && rom[addr + 1] == 0) {
+			// the line decoder needs at least one pixel
+			if (rom[addr] && rom[addr + 2]) rle[nrle++] = i;
+		}
+		else if (rom[addr] == 0x81) sound[nsound++] = i;
+		else {
+			int w = rom[addr], h = rom[addr + 1];
+			if (w <= 0x80 && h <= 0x80 && (int)res_size == ((w + 7) >> 3) * h + 2)
+				bits[nbits++] = i;
+		}
+	}
+	printf("images: %u, 1-bit images: %u, sounds: %u\n", nrle, nbits, nsound);
+	printf("%-24s %-5s %9s %9s %9s %7s\n",
+			"(ns per unit)", "unit", "min", "median", "avg", "stddev");
+
+	memset(&b, 0, sizeof(b));
+	b.sys = &sys;
+	b.cpu = &cpu;
+
+	b.list = rle; b.count = nrle;
+	for (i = 0; i < 16; i++) {
+		b.flip = i & 3;
+		b.blend = i & 4 ? 0x49 : 0xff;
+		b.alpha = i & 8 ? 0xff : -1;
+		snprintf(name, sizeof(name), "draw_image f%u%s%s", b.flip,
+				i & 4 ? " blend" : "", i & 8 ? " alpha" : "");
+		bench_run(&b, name, "px", k_draw_image);
+	}
+	b.list = bits; b.count = nbits;
+	b.flip = 4; b.blend = 0xff; b.alpha = -1;
+	bench_run(&b, "draw_image 1-bit", "px", k_draw_image);
+
+	b.list = rle; b.count = nrle;
+	for (i = 0; i < 4; i++) {
+		b.flip = i;
+		snprintf(name, sizeof(name), "decode_line f%u", i);
+		bench_run(&b, name, "px", k_decode_line);
+	}
+	b.flip = 0;
+	bench_run(&b, "check_intersect", "call", k_intersect);
+
+	b.alpha = 0;
+	bench_run(&b, "draw_char", "px", k_draw_char);
+	b.alpha = -1;
+	bench_run(&b, "draw_char alpha", "px", k_draw_char);
+
+	for (i = 1; i <= 8; i++) {
+		free(sys.window.imagedata);
+		sys.zoom = i;
+		sys_init(&sys);
+		snprintf(name, sizeof(name), "sys_update zoom %u", i);
+		bench_run(&b, name, "px", k_update);
+	}
+
+	bench_run(&b, "flash_emu", "byte", k_flash);
+
+	b.list = sound; b.count = nsound;
+	bench_run(&b, "adpcm_decode", "byte", k_adpcm);
+
+	b.blend = sys.rom_key ? sys.rom_key : 0x5a;
+	bench_run(&b, "rom_xor", "byte", k_xor);
+
+	sys_close(&sys);
+	free(rom);
+	return 0;
+}
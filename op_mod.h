@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024, Ilya Kurdyukov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY
+ * DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/* 65C02 addressing modes, opcode table and BIOS call names, */
+/* shared by the emulator and the disassembler. */
+
+#ifndef OP_MOD_H
+#define OP_MOD_H
+
+enum {
+	MOD_NUL, /* none */
+	MOD_IMM, /* # */
+	MOD_ACC, /* A */
+	MOD_X,   /* X */
+	MOD_Y,   /* Y */
+	MOD_Z,   /* zp */
+	MOD_ZX,  /* zp,x */
+	MOD_ZY,  /* zp,y */
+	MOD_ZI,  /* (zp) */
+	MOD_ZXI, /* (zp,x) */
+	MOD_ZIY, /* (zp),y */
+	MOD_A,   /* a */
+	MOD_AX,  /* a,x */
+	MOD_AY,  /* a,y */
+	MOD_R,   /* r */
+	MOD_LAST,
+	MOD_ZR = MOD_Z /* zp + r */
+};
+
+/* X(mode, "opcode name"), S() is for the stores */
+#define OP_TABLE(X, S) \
+	X(NUL, "0x00 BRK") X(ZXI, "0x01 ORA") X(NUL, "0x02 ---") X(NUL, "0x03 ---") \
+	X(Z,   "0x04 TSB") X(Z,   "0x05 ORA") X(Z,   "0x06 ASL") X(Z,   "0x07 RMB") \
+	X(NUL, "0x08 PHP") X(IMM, "0x09 ORA") X(ACC, "0x0A ASL") X(NUL, "0x0B ---") \
+	X(A,   "0x0C TSB") X(A,   "0x0D ORA") X(A,   "0x0E ASL") X(ZR,  "0x0F BBR") \
+\
+	X(R,   "0x10 BPL") X(ZIY, "0x11 ORA") X(ZI,  "0x12 ORA") X(NUL, "0x13 ---") \
+	X(Z,   "0x14 TRB") X(ZX,  "0x15 ORA") X(ZX,  "0x16 ASL") X(Z,   "0x17 RMB") \
+	X(NUL, "0x18 CLC") X(AY,  "0x19 ORA") X(ACC, "0x1A INC") X(NUL, "0x1B ---") \
+	X(A,   "0x1C TRB") X(AX,  "0x1D ORA") X(AX,  "0x1E ASL") X(ZR,  "0x1F BBR") \
+\
+	X(IMM, "0x20 JSR") X(ZXI, "0x21 AND") X(NUL, "0x22 ---") X(NUL, "0x23 ---") \
+	X(Z,   "0x24 BIT") X(Z,   "0x25 AND") X(Z,   "0x26 ROL") X(Z,   "0x27 RMB") \
+	X(NUL, "0x28 PLP") X(IMM, "0x29 AND") X(ACC, "0x2A ROL") X(NUL, "0x2B ---") \
+	X(A,   "0x2C BIT") X(A,   "0x2D AND") X(A,   "0x2E ROL") X(ZR,  "0x2F BBR") \
+\
+	X(R,   "0x30 BMI") X(ZIY, "0x31 AND") X(ZI,  "0x32 AND") X(NUL, "0x33 ---") \
+	X(Z,   "0x34 BIT") X(ZX,  "0x35 AND") X(ZX,  "0x36 ROL") X(Z,   "0x37 RMB") \
+	X(NUL, "0x38 SEC") X(AY,  "0x39 AND") X(ACC, "0x3A DEC") X(NUL, "0x3B ---") \
+	X(AX,  "0x3C BIT") X(AX,  "0x3D AND") X(AX,  "0x3E ROL") X(ZR,  "0x3F BBR") \
+\
+	X(NUL, "0x40 RTI") X(ZXI, "0x41 EOR") X(NUL, "0x42 ---") X(NUL, "0x43 ---") \
+	X(NUL, "0x44 ---") X(Z,   "0x45 EOR") X(Z,   "0x46 LSR") X(Z,   "0x47 RMB") \
+	X(ACC, "0x48 PHA") X(IMM, "0x49 EOR") X(ACC, "0x4A LSR") X(NUL, "0x4B ---") \
+	X(IMM, "0x4C JMP") X(A,   "0x4D EOR") X(A,   "0x4E LSR") X(ZR,  "0x4F BBR") \
+\
+	X(R,   "0x50 BVC") X(ZIY, "0x51 EOR") X(ZI,  "0x52 EOR") X(NUL, "0x53 ---") \
+	X(NUL, "0x54 ---") X(ZX,  "0x55 EOR") X(ZX,  "0x56 LSR") X(Z,   "0x57 RMB") \
+	X(NUL, "0x58 CLI") X(AY,  "0x59 EOR") X(Y,   "0x5A PHY") X(NUL, "0x5B ---") \
+	X(NUL, "0x5C ---") X(AX,  "0x5D EOR") X(AX,  "0x5E LSR") X(ZR,  "0x5F BBR") \
+\
+	X(NUL, "0x60 RTS") X(ZXI, "0x61 ADC") X(NUL, "0x62 ---") X(NUL, "0x63 ---") \
+	S(Z,   "0x64 STZ") X(Z,   "0x65 ADC") X(Z,   "0x66 ROR") X(Z,   "0x67 RMB") \
+	X(ACC, "0x68 PLA") X(IMM, "0x69 ADC") X(ACC, "0x6A ROR") X(NUL, "0x6B ---") \
+	X(A,   "0x6C JMP") X(A,   "0x6D ADC") X(A,   "0x6E ROR") X(ZR,  "0x6F BBR") \
+\
+	X(R,   "0x70 BVS") X(ZIY, "0x71 ADC") X(ZI,  "0x72 ADC") X(NUL, "0x73 ---") \
+	S(ZX,  "0x74 STZ") X(ZX,  "0x75 ADC") X(ZX,  "0x76 ROR") X(Z,   "0x77 RMB") \
+	X(NUL, "0x78 SEI") X(AY,  "0x79 ADC") X(Y,   "0x7A PLY") X(NUL, "0x7B ---") \
+	X(AX,  "0x7C JMP") X(AX,  "0x7D ADC") X(AX,  "0x7E ROR") X(ZR,  "0x7F BBR") \
+\
+	X(R,   "0x80 BRA") S(ZXI, "0x81 STA") X(NUL, "0x82 ---") X(NUL, "0x83 ---") \
+	S(Z,   "0x84 STY") S(Z,   "0x85 STA") S(Z,   "0x86 STX") X(Z,   "0x87 SMB") \
+	X(Y,   "0x88 DEY") X(IMM, "0x89 BIT") X(NUL, "0x8A TXA") X(NUL, "0x8B ---") \
+	S(A,   "0x8C STY") S(A,   "0x8D STA") S(A,   "0x8E STX") X(ZR,  "0x8F BBS") \
+\
+	X(R,   "0x90 BCC") S(ZIY, "0x91 STA") S(ZI,  "0x92 STA") X(NUL, "0x93 ---") \
+	S(ZX,  "0x94 STY") S(ZX,  "0x95 STA") S(ZY,  "0x96 STX") X(Z,   "0x97 SMB") \
+	X(NUL, "0x98 TYA") S(AY,  "0x99 STA") X(NUL, "0x9A TXS") X(NUL, "0x9B ---") \
+	S(A,   "0x9C STZ") S(AX,  "0x9D STA") S(AX,  "0x9E STZ") X(ZR,  "0x9F BBS") \
+\
+	X(IMM, "0xA0 LDY") X(ZXI, "0xA1 LDA") X(IMM, "0xA2 LDX") X(NUL, "0xA3 ---") \
+	X(Z,   "0xA4 LDY") X(Z,   "0xA5 LDA") X(Z,   "0xA6 LDX") X(Z,   "0xA7 SMB") \
+	X(NUL, "0xA8 TAY") X(IMM, "0xA9 LDA") X(NUL, "0xAA TAX") X(NUL, "0xAB ---") \
+	X(A,   "0xAC LDY") X(A,   "0xAD LDA") X(A,   "0xAE LDX") X(ZR,  "0xAF BBS") \
+\
+	X(R,   "0xB0 BCS") X(ZIY, "0xB1 LDA") X(ZI,  "0xB2 LDA") X(NUL, "0xB3 ---") \
+	X(ZX,  "0xB4 LDY") X(ZX,  "0xB5 LDA") X(ZY,  "0xB6 LDX") X(Z,   "0xB7 SMB") \
+	X(NUL, "0xB8 CLV") X(AY,  "0xB9 LDA") X(NUL, "0xBA TSX") X(NUL, "0xBB ---") \
+	X(AX,  "0xBC LDY") X(AX,  "0xBD LDA") X(AY,  "0xBE LDX") X(ZR,  "0xBF BBS") \
+\
+	X(IMM, "0xC0 CPY") X(ZXI, "0xC1 CMP") X(NUL, "0xC2 ---") X(NUL, "0xC3 ---") \
+	X(Z,   "0xC4 CPY") X(Z,   "0xC5 CMP") X(Z,   "0xC6 DEC") X(Z,   "0xC7 SMB") \
+	X(Y,   "0xC8 INY") X(IMM, "0xC9 CMP") X(X,   "0xCA DEX") X(NUL, "0xCB WAI") \
+	X(A,   "0xCC CPY") X(A,   "0xCD CMP") X(A,   "0xCE DEC") X(ZR,  "0xCF BBS") \
+\
+	X(R,   "0xD0 BNE") X(ZIY, "0xD1 CMP") X(ZI,  "0xD2 CMP") X(NUL, "0xD3 ---") \
+	X(NUL, "0xD4 ---") X(ZX,  "0xD5 CMP") X(ZX,  "0xD6 DEC") X(Z,   "0xD7 SMB") \
+	X(NUL, "0xD8 CLD") X(AY,  "0xD9 CMP") X(X,   "0xDA PHX") X(NUL, "0xDB STP") \
+	X(NUL, "0xDC ---") X(AX,  "0xDD CMP") X(AX,  "0xDE DEC") X(ZR,  "0xDF BBS") \
+\
+	X(IMM, "0xE0 CPX") X(ZXI, "0xE1 SBC") X(NUL, "0xE2 ---") X(NUL, "0xE3 ---") \
+	X(Z,   "0xE4 CPX") X(Z,   "0xE5 SBC") X(Z,   "0xE6 INC") X(Z,   "0xE7 SMB") \
+	X(X,   "0xE8 INX") X(IMM, "0xE9 SBC") X(NUL, "0xEA NOP") X(NUL, "0xEB ---") \
+	X(A,   "0xEC CPX") X(A,   "0xED SBC") X(A,   "0xEE INC") X(ZR,  "0xEF BBS") \
+\
+	X(R,   "0xF0 BEQ") X(ZIY, "0xF1 SBC") X(ZI,  "0xF2 SBC") X(NUL, "0xF3 ---") \
+	X(NUL, "0xF4 ---") X(ZX,  "0xF5 SBC") X(ZX,  "0xF6 INC") X(Z,   "0xF7 SMB") \
+	X(NUL, "0xF8 SED") X(AY,  "0xF9 SBC") X(X,   "0xFA PLX") X(NUL, "0xFB ---") \
+	X(NUL, "0xFC ---") X(AX,  "0xFD SBC") X(AX,  "0xFE INC") X(ZR,  "0xFF BBS")
+
+static const char * const bios_names[0x30 >> 1] = {
+	[0x06 >> 1] = "image_size",
+	[0x08 >> 1] = "image_draw_alpha",
+	[0x0a >> 1] = "image_draw",
+	[0x0c >> 1] = "clear_screen",
+	[0x0e >> 1] = "repeat_line",
+	[0x10 >> 1] = "check_intersect",
+	[0x14 >> 1] = "play_sound_0",
+	[0x16 >> 1] = "play_sound_1",
+	[0x18 >> 1] = "play_sound_2",
+	[0x1a >> 1] = "play_sound",
+	[0x1c >> 1] = "play_music",
+	[0x1e >> 1] = "stop_music",
+	[0x24 >> 1] = "draw_char_alpha",
+	[0x26 >> 1] = "draw_char",
+	[0x2c >> 1] = "play_sound_2a",
+};
+
+#endif
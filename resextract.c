@@ -1,7 +1,17 @@
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
+#include <pthread.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 #define ERR_EXIT(...) do { \
 	fprintf(stderr, __VA_ARGS__); exit(1); \
@@ -26,59 +36,97 @@ static uint8_t* loadfile(const char *fn, size_t *num, size_t nmax) {
 	return buf;
 }
 
+/* The ROM is mapped copy-on-write, the pages are only */
+/* copied by the key XOR. */
+
+static uint8_t* mapfile(const char *fn, size_t *num, size_t nmax) {
+#ifndef _WIN32
+	struct stat st; void *p = NULL;
+	int fd = open(fn, O_RDONLY);
+	*num = 0;
+	if (fd < 0) return NULL;
+	if (!fstat(fd, &st) && st.st_size && (size_t)st.st_size <= nmax) {
+		p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED) p = NULL;
+		else *num = st.st_size;
+	}
+	close(fd);
+	return p;
+#else
+	return loadfile(fn, num, nmax);
+#endif
+}
+
+static void unmapfile(uint8_t *p, size_t size) {
+#ifndef _WIN32
+	munmap(p, size);
+#else
+	free(p);
+#endif
+}
+
+static void rom_xor(uint8_t *p, size_t n, unsigned key) {
+	uint64_t a, k = key * 0x0101010101010101ull;
+	size_t i = 0;
+	if (!key) return;
+	// the compiler vectorizes this loop
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&a, p + i, 8); a ^= k; memcpy(p + i, &a, 8);
+	}
+	for (; i < n; i++) p[i] ^= key;
+}
+
 static uint8_t pal[256][3];
 
 #define READ16(p) ((p)[0] | (p)[1] << 8)
 #define READ24(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16)
 
-static int decode_image_1bit(uint8_t *src, size_t size, const char *fn) {
-	int w, h, x, y; const char *err_str;
-	uint8_t *data = NULL, *d; FILE *f;
+/* The decoders return an error string or NULL, so that the messages */
+/* can be printed in order. The output file is assembled in one buffer. */
+
+typedef struct {
+	uint8_t *data;
+	size_t size;
+} out_t;
 
 #define GOTO_ERR(str) do { \
 	err_str = str; goto err; \
 } while (0)
 
+static const char* decode_image_1bit(uint8_t *src, size_t size, out_t *out) {
+	int w, h, x, y; const char *err_str;
+	uint8_t *d;
+
 	if (size < 2) GOTO_ERR("too small");
 	w = src[0]; h = src[1]; src += 2;
-	data = malloc(w * h);
-	if (!data) GOTO_ERR("malloc failed");
 	x = ((w + 7) >> 3) * h + 2;
-	if (size < x) GOTO_ERR("too small");
+	if ((int)size < x) GOTO_ERR("too small");
+	out->data = d = malloc(32 + (w + 1) * h);
+	if (!d) GOTO_ERR("malloc failed");
 
-	d = data;
-	for (y = 0; y < h; y++, d += w) {
+	d += sprintf((char*)d, "P1\n%u %u\n", w, h);
+	for (y = 0; y < h; y++, d += w + 1) {
 		int a = -1;
 		for (x = 0; x < w; x++, a <<= 1) {
 			if (a & 1 << 16) a = *src++ | 0x100;
 			d[x] = (a >> 7 & 1) + '0';
 		}
+		d[w] = '\n';
 	}
-#undef GOTO_ERR
-
-	f = fopen(fn, "wb");
-	if (f) {
-		fprintf(f, "P1\n%u %u\n", w, h);
-		for (y = 0; y < h; y++, fputs("\n", f))
-			fwrite(data + y * w, 1, w, f);
-		fclose(f);
-	}
-	free(data);
-	return 0;
+	out->size = d - out->data;
+	return NULL;
 
 err:
-	printf("unpack_image failed (%s)\n", err_str);
-	if (data) free(data);
-	return 1;
+	return err_str;
 }
 
-static int decode_image(uint8_t *src, size_t size, const char *fn) {
-	int w, h, x, y; const char *err_str;
-	uint8_t *data = NULL, *d; FILE *f;
+/* RGB palette as 32-bit words, each pixel is stored with */
+/* one 4-byte write, the extra byte is overwritten by the next pixel */
+static uint32_t pal32[256];
 
-#define GOTO_ERR(str) do { \
-	err_str = str; goto err; \
-} while (0)
+static const char* decode_image(uint8_t *src, size_t size, out_t *out) {
+	int w, h, x, y, n; const char *err_str;
+	uint8_t *data = NULL, *d;
 
 	if (size < 4) GOTO_ERR("too small");
 	size -= 4;
@@ -92,7 +140,7 @@ static int decode_image(uint8_t *src, size_t size, const char *fn) {
 	for (y = 0; y < h; y++, d += w) {
 		int len = READ16(src), a = 0, n = 1;
 		uint8_t *s = src + 2;
-		if (size < len) GOTO_ERR("end of file");
+		if ((int)size < len) GOTO_ERR("end of file");
 		src += len; size -= len; len -= 4;
 		for (x = 0; x < w; x++) {
 			if (!--n) {
@@ -107,104 +155,25 @@ static int decode_image(uint8_t *src, size_t size, const char *fn) {
 			d[x] = a;
 		}
 	}
-#undef GOTO_ERR
 
-	f = fopen(fn, "wb");
-	if (f) {
-		fprintf(f, "P6\n%u %u\n255\n", w, h);
-		for (y = 0; y < h; y++)
-		for (x = 0; x < w; x++)
-			fwrite(pal[data[y * w + x]], 1, 3, f);
-		fclose(f);
-	}
+	n = w * h;
+	out->data = d = malloc(32 + n * 3 + 1);
+	if (!d) GOTO_ERR("malloc failed");
+	d += sprintf((char*)d, "P6\n%u %u\n255\n", w, h);
+	for (x = 0; x < n; x++, d += 3)
+		memcpy(d, &pal32[data[x]], 4);
+	out->size = d - out->data;
 	free(data);
-	return 0;
+	return NULL;
 
 err:
-	printf("unpack_image failed (%s)\n", err_str);
 	if (data) free(data);
-	return 1;
+	return err_str;
 }
 
-#if 1
-// uses unknown 4-bit ADPCM
-static uint8_t adpcm_value[256] = {
-	0xff, 0xff, 0xff, 0x00, 0x00, 0x02, 0x03, 0x05,
-	0xfe, 0xfe, 0xff, 0xfe, 0x00, 0x03, 0x08, 0x0a,
-	0xfd, 0xfd, 0xfe, 0xfd, 0xfd, 0xfe, 0xfd, 0x04,
-	0xfd, 0xfc, 0xfc, 0xfb, 0xfb, 0xfc, 0xff, 0x07,
-	0xfd, 0xfb, 0xfb, 0xfb, 0xfb, 0xfc, 0x00, 0x0a,
-	0xfc, 0xfb, 0xfa, 0xfa, 0xfb, 0xfc, 0xff, 0x0b,
-	0xfb, 0xfb, 0xfb, 0xfb, 0xfb, 0xfc, 0xff, 0x0c,
-	0xfa, 0xfa, 0xfa, 0xfa, 0xfa, 0xfc, 0x01, 0x11,
-	0xf9, 0xf9, 0xfa, 0xfa, 0xfa, 0xfc, 0x01, 0x13,
-	0xf9, 0xf9, 0xf8, 0xf8, 0xf8, 0xfa, 0xff, 0x11,
-	0xf9, 0xf9, 0xf7, 0xf6, 0xf6, 0xf7, 0xfd, 0x17,
-	0xf8, 0xf8, 0xf8, 0xf6, 0xf6, 0xf8, 0x00, 0x1e,
-	0xf7, 0xf7, 0xf7, 0xf6, 0xf7, 0xf9, 0x06, 0x38,
-	0xf6, 0xf6, 0xf6, 0xf5, 0xf6, 0xfb, 0x0a, 0x33,
-	0xf6, 0xf7, 0xf6, 0xf5, 0xf6, 0xfa, 0x07, 0x2e,
-	0xf6, 0xf7, 0xf6, 0xf5, 0xf5, 0xf8, 0x04, 0x2f,
-	0xf5, 0xf6, 0xf6, 0xf6, 0xf5, 0xf8, 0x01, 0x28,
-	0xf6, 0xf6, 0xf5, 0xf5, 0xf5, 0xf7, 0x00, 0x21,
-	0xf6, 0xf7, 0xf7, 0xf7, 0xf8, 0xfb, 0x04, 0x1c,
-	0xf6, 0xf6, 0xf7, 0xf7, 0xf8, 0xfb, 0x02, 0x15,
-	0xf6, 0xf7, 0xf8, 0xf8, 0xfa, 0xfd, 0x04, 0x18,
-	0xf6, 0xf8, 0xfa, 0xfa, 0xfa, 0xff, 0x05, 0x1e,
-	0xf6, 0xf7, 0xfc, 0xfd, 0xff, 0x03, 0x08, 0x19,
-	0xf7, 0xfa, 0x00, 0x00, 0x04, 0x07, 0x0a, 0x13,
-	0xf8, 0xfd, 0x03, 0x08, 0x0c, 0x0d, 0x13, 0x1c,
-	0xf8, 0x00, 0x08, 0x0c, 0x0d, 0x13, 0x1a, 0x1c,
-	0xf8, 0x04, 0x0a, 0x10, 0x10, 0x0f, 0x16, 0x17,
-	0xfc, 0x04, 0x0f, 0x13, 0x18, 0x19, 0x19, 0x10,
-	0xfd, 0x08, 0x12, 0x1f, 0x1f, 0x25, 0x21, 0x0d,
-	0xfd, 0x0a, 0x10, 0x1e, 0x23, 0x2a, 0x1b, 0x09,
-	0xfe, 0x0a, 0x0e, 0x25, 0x1f, 0x29, 0x25, 0x06,
-	0xfe, 0x0d, 0x19, 0x33, 0x55, 0x3e, 0x1e, 0xfe };
-
-static uint8_t adpcm_next[256];
-
-typedef struct { uint8_t idx; } adpcm_status_t;
-
-static void adpcm_init(adpcm_status_t *adpcm) {
-	int i;
-	adpcm->idx = 0;
-	if (adpcm_next[7]) return;
-	for (i = 0; i < 256; i++) {
-		int a = i >> 3;
-#define X(thr) ((a + (32 - thr)) >> 5)
-		switch (i & 7) {
-		case 0: a -= 1 + X(20) + X(30); break;
-		case 1: a -= 1 + X(26) + X(30); break;
-		case 2: a -= 1 + X(28); break;
-		case 3: a -= X(27) + X(29); break;
-		case 7: a += 4 + X(11) + X(12); break;
-#undef X
-		default: a++;
-		}
-		a = a < 0 ? 0 : a > 31 ? 31 : a;
-		adpcm_next[i] = a * 8;
-		adpcm_value[i] += ((i & 7) + 1) * ((i >> 3) + 1);
-	}
-}
+#include "adpcm.h"
 
-static int adpcm_decode(adpcm_status_t *adpcm, unsigned x) {
-	unsigned a = (x & 7) | adpcm->idx;
-	adpcm->idx = adpcm_next[a];
-	a = adpcm_value[a];
-	return (x & 8 ? -a : a) << 6;
-}
-#else
-typedef struct { uint8_t dummy; } adpcm_status_t;
-static void adpcm_init(adpcm_status_t *adpcm) {}
-// this rough guess sounds close
-static int adpcm_decode(adpcm_status_t *adpcm, unsigned x) {
-	x = x & 8 ? 7 - x : x;
-	return x << 11;
-}
-#endif
-
-static void decode_sound(uint8_t *src, size_t size, const char *fn) {
+static const char* decode_sound(uint8_t *src, size_t size, out_t *out) {
 	struct {
 		char riff[4];
 		uint32_t file_size;
@@ -217,21 +186,10 @@ static void decode_sound(uint8_t *src, size_t size, const char *fn) {
 		char data[4];
 		uint32_t data_size;
 	} head;
-	FILE *f;
 	int bits = 16, ch = 1, freq = 8000, i;
 	int bytes_sample = ch * (bits >> 3);
 	int samples = (size - 1) * 2;
-	int16_t *d, *data = malloc(samples * sizeof(*d));
-	adpcm_status_t adpcm;
-	if (!data) { printf("malloc failed"); return; }
-
-	d = data;
-	adpcm_init(&adpcm);
-	for (i = 1; i < size; i++) {
-		int a = src[i];
-		*d++ = adpcm_decode(&adpcm, a & 15);
-		*d++ = adpcm_decode(&adpcm, a >> 4);
-	}
+	int16_t *d;
 
 	memcpy(head.riff, "RIFF", 4);
 	memcpy(head.wavefmt, "WAVEfmt ", 8);
@@ -244,15 +202,26 @@ static void decode_sound(uint8_t *src, size_t size, const char *fn) {
 	head.bits = bits;
 	memcpy(head.data, "data", 4);
 	head.data_size = samples * bytes_sample;
-
-	f = fopen(fn, "wb");
-	if (f) {
-		fwrite(&head, 1, sizeof(head), f);
-		fwrite(data, 1, head.data_size, f);
-		fclose(f);
+	head.file_size = sizeof(head) - 8 + head.data_size;
+
+	out->size = sizeof(head) + head.data_size;
+	out->data = malloc(out->size);
+	if (!out->data) return "malloc failed";
+	memcpy(out->data, &head, sizeof(head));
+
+	d = (int16_t*)(out->data + sizeof(head));
+	{
+		adpcm_status_t adpcm;
+		adpcm_init(&adpcm);
+		for (i = 1; i < (int)size; i++) {
+			int a = src[i];
+			*d++ = adpcm_decode(&adpcm, a & 15);
+			*d++ = adpcm_decode(&adpcm, a >> 4);
+		}
 	}
-	free(data);
+	return NULL;
 }
+#undef GOTO_ERR
 
 typedef struct {
 	uint8_t *rom;
@@ -272,21 +241,547 @@ static void check_rom(sysctx_t *sys) {
 		if ((sys->rom[moffs + i] ^ key) != (unsigned)magic[i])
 			ERR_EXIT("ROM magic doesn't match\n");
 	}
-	if (key)
-	for (i = 0; i < rom_size; i++) sys->rom[i] ^= key;
+	rom_xor(sys->rom, rom_size, key);
 	res_offs = READ24(sys->rom);
 	if (rom_size < res_offs)
 		ERR_EXIT("bad resources offset\n");
 }
 
+enum { RES_BIN, RES_IMAGE, RES_SOUND, RES_1BIT };
+
+/* for the manifest, "dup" is the first resource with the same content */
+typedef struct {
+	uint64_t hash;
+	unsigned dup;
+	uint8_t type, skip, failed;
+} res_info_t;
+
+typedef struct {
+	uint8_t *rom;
+	unsigned rom_size, res_tab;
+	const char *out_fn;
+	int single;
+	unsigned first, count, next, quit;
+	const char **err;
+	uint8_t *done;
+	FILE *tar, *log;
+	out_t *tar_out;
+	res_info_t *info;
+	const char *atlas;
+	out_t *atlas_out;
+	int *atlas_of;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+} job_t;
+
+static const char err_create[] = "can't create file";
+
+static const char err_tar[] = "can't write archive";
+
+/* writes a ustar header, long names are split at a slash */
+static int tar_head(uint8_t *h, const char *name, size_t size) {
+	size_t n = strlen(name), pre = 0;
+	unsigned i, sum = 0;
+	memset(h, 0, 512);
+	if (n > 100) {
+		const char *s = strchr(name + n - 101, '/');
+		if (!s || (pre = s - name) > 155 || !pre) return 1;
+		memcpy(h + 345, name, pre);
+		pre++;
+	}
+	memcpy(h, name + pre, n - pre);
+	sprintf((char*)h + 100, "%07o", 0644);
+	sprintf((char*)h + 108, "%07o", 0);
+	sprintf((char*)h + 116, "%07o", 0);
+	sprintf((char*)h + 124, "%011llo", (unsigned long long)size);
+	sprintf((char*)h + 136, "%011o", 0);
+	h[156] = '0';
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+	memset(h + 148, ' ', 8);
+	for (i = 0; i < 512; i++) sum += h[i];
+	sprintf((char*)h + 148, "%06o", sum);
+	h[155] = ' ';
+	return 0;
+}
+
+/* writes one file or one archive member */
+static const char* put_file(job_t *job, const char *name, const uint8_t *data, size_t size) {
+	static const uint8_t zero[512];
+	uint8_t head[512];
+	FILE *f; size_t n = 0;
+
+	if (job->tar) {
+		if (tar_head(head, name, size) ||
+				fwrite(head, 1, 512, job->tar) != 512 ||
+				fwrite(data, 1, size, job->tar) != size ||
+				fwrite(zero, 1, -size & 511, job->tar) != (-size & 511))
+			return err_tar;
+		return NULL;
+	}
+	f = fopen(name, "wb");
+	if (f) {
+		// one write for the whole file
+		setvbuf(f, NULL, _IONBF, 0);
+		n = fwrite(data, 1, size, f);
+		fclose(f);
+	}
+	return f && n == size ? NULL : err_create;
+}
+
+/* All output goes through here. Takes the buffer if "own" is set. */
+/* In the archive mode the buffer is kept until the main thread */
+/* writes it, so the archive is in the order of the resources. */
+
+static const char* out_write(job_t *job, unsigned i, const char *name, out_t *out, int own) {
+	const char *err;
+	if (job->tar) {
+		job->tar_out[i - job->first] = *out;
+		if (!own) job->tar_out[i - job->first].data = NULL;
+		return NULL;
+	}
+	err = put_file(job, name, out->data, out->size);
+	if (own) free(out->data);
+	return err;
+}
+
+static int res_type(const uint8_t *p, unsigned size) {
+	if (size < 4) return RES_BIN;
+	if (p[3] == 0x80 && p[1] == 0) return RES_IMAGE;
+#if 1
+	if (p[0] == 0x81) return RES_SOUND;
+#endif
+	{
+		int w = p[0], h = p[1];
+		int st = (w + 7) >> 3;
+		if (w <= 0x80 && h <= 0x80 && (int)size == st * h + 2) return RES_1BIT;
+	}
+	return RES_BIN;
+}
+
+static void res_range(job_t *job, unsigned i, unsigned *addr, unsigned *size) {
+	uint8_t *p = job->rom + job->res_tab + i * 3;
+	unsigned next = READ24(p + 3);
+	if (next == 0xffffff) next = job->res_tab;
+	*addr = READ24(p);
+	*size = next - *addr;
+}
+
+static int res_name(job_t *job, unsigned i, char *name, unsigned n) {
+	static const char * const ext[] = { "bin", "ppm", "wav", "pbm" };
+	unsigned addr, size; int type;
+
+	res_range(job, i, &addr, &size);
+	type = res_type(job->rom + addr, size);
+	if (job->single)
+		snprintf(name, n, "%s.%s", job->out_fn, ext[type]);
+	else
+		snprintf(name, n, "%s%u.%s", job->out_fn, i, ext[type]);
+	return type;
+}
+
+static const char* extract_res(job_t *job, unsigned i) {
+	char name[256]; unsigned addr, size;
+	uint8_t *src; int type;
+	out_t out = { NULL, 0 };
+	const char *err;
+
+	if (job->info && job->info[i - job->first].skip) return NULL;
+	res_range(job, i, &addr, &size);
+	src = job->rom + addr;
+	type = res_name(job, i, name, sizeof(name));
+
+	switch (type) {
+	case RES_IMAGE: err = decode_image(src, size, &out); break;
+	case RES_SOUND: err = decode_sound(src, size, &out); break;
+	case RES_1BIT: err = decode_image_1bit(src, size, &out); break;
+	default:
+		out.data = src; out.size = size;
+		return out_write(job, i, name, &out, 0);
+	}
+	if (err) {
+		free(out.data);
+		return err;
+	}
+	if (job->atlas && type != RES_SOUND) {
+		// packed by the main thread at the end
+		job->atlas_out[i - job->first] = out;
+		return NULL;
+	}
+	return out_write(job, i, name, &out, 1);
+}
+
+static void res_dims(job_t *job, unsigned i, unsigned *w, unsigned *h) {
+	unsigned addr, size; uint8_t *p;
+	res_range(job, i, &addr, &size);
+	p = job->rom + addr;
+	*w = *h = 0;
+	switch (res_type(p, size)) {
+	case RES_IMAGE: *w = p[0]; *h = p[2]; break;
+	case RES_1BIT: *w = p[0]; *h = p[1]; break;
+	}
+}
+
+static uint64_t hash64(const uint8_t *p, size_t n) {
+	uint64_t h = n * 0x9e3779b97f4a7c15ull, a;
+	for (; n >= 8; n -= 8, p += 8) {
+		memcpy(&a, p, 8);
+		h = (h ^ a) * 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+	}
+	a = 0; memcpy(&a, p, n);
+	h = (h ^ a) * 0xff51afd7ed558ccdull;
+	h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ull; h ^= h >> 33;
+	return h;
+}
+
+typedef struct {
+	uint64_t hash;
+	unsigned size, idx;
+	char *name;
+} hash_ent_t;
+
+static int hash_cmp(const void *a, const void *b) {
+	const hash_ent_t *x = a, *y = b;
+	if (x->hash != y->hash) return x->hash < y->hash ? -1 : 1;
+	if (x->size != y->size) return x->size < y->size ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* Hashes the resources and finds the duplicates. The entries with */
+/* the same hash are compared, so the collisions don't matter. */
+
+static void res_hash(job_t *job) {
+	unsigned i, j, k, addr, size, n = job->count;
+	hash_ent_t *tab = malloc((n + 1) * sizeof(*tab));
+	res_info_t *info = calloc(n + 1, sizeof(*info));
+	if (!tab || !info) ERR_EXIT("malloc failed\n");
+	for (i = 0; i < n; i++) {
+		res_range(job, job->first + i, &addr, &size);
+		info[i].hash = hash64(job->rom + addr, size);
+		info[i].type = res_type(job->rom + addr, size);
+		info[i].dup = i;
+		tab[i].hash = info[i].hash;
+		tab[i].size = size;
+		tab[i].idx = i;
+	}
+	qsort(tab, n, sizeof(*tab), hash_cmp);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && tab[j].hash == tab[i].hash && tab[j].size == tab[i].size; j++) {
+			unsigned a = tab[j].idx, b;
+			res_range(job, job->first + a, &addr, &size);
+			for (k = i; k < j; k++) {
+				unsigned addr2;
+				b = tab[k].idx;
+				if (info[b].dup != b) continue;
+				res_range(job, job->first + b, &addr2, &size);
+				if (!memcmp(job->rom + addr, job->rom + addr2, size)) {
+					info[a].dup = b; info[a].skip = 1;
+					break;
+				}
+			}
+		}
+	}
+	free(tab);
+	job->info = info;
+}
+
+static const char * const type_names[] = { "bin", "image", "sound", "1bit" };
+
+/* the size of the file extract_res writes */
+static unsigned long res_out_size(job_t *job, unsigned i) {
+	unsigned addr, size, w, h;
+	res_range(job, i, &addr, &size);
+	res_dims(job, i, &w, &h);
+	switch (res_type(job->rom + addr, size)) {
+	case RES_IMAGE: return snprintf(NULL, 0, "P6\n%u %u\n255\n", w, h) + w * h * 3ul;
+	case RES_SOUND: return 44 + (size - 1) * 4ul;
+	case RES_1BIT: return snprintf(NULL, 0, "P1\n%u %u\n", w, h) + (w + 1ul) * h;
+	}
+	return size;
+}
+
+/* Reads the manifest of the previous run. The resource isn't */
+/* extracted again if the file it goes to already has the same content. */
+/* In the archive mode there's no file to check, the archive only */
+/* gets the new and changed resources. */
+
+static void res_prev(job_t *job, const char *fn, int check) {
+	FILE *f = fopen(fn, "r");
+	char line[512], name[256], *pname;
+	hash_ent_t *tab = NULL, key, *e;
+	unsigned n = 0, max = 0, i;
+	unsigned long long hash;
+
+	if (!f) ERR_EXIT("can't open manifest\n");
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#') continue;
+		if (sscanf(line, "%*u %*x %u %*s %*u %*u %llx %255s",
+				&key.size, &hash, name) != 3) continue;
+		if (!strcmp(name, "-")) continue;
+		if (n == max) {
+			max = max ? max * 2 : 256;
+			tab = realloc(tab, max * sizeof(*tab));
+			if (!tab) ERR_EXIT("malloc failed\n");
+		}
+		tab[n].hash = hash;
+		tab[n].size = key.size;
+		tab[n].idx = 0;
+		tab[n].name = strdup(name);
+		if (!tab[n].name) ERR_EXIT("malloc failed\n");
+		n++;
+	}
+	fclose(f);
+	if (!n) return;
+	qsort(tab, n, sizeof(*tab), hash_cmp);
+
+	for (i = 0; i < job->count; i++) {
+		res_info_t *info = &job->info[i];
+		unsigned addr;
+		if (info->skip) continue;
+		res_range(job, job->first + i, &addr, &key.size);
+		key.hash = info->hash;
+		key.idx = 0;
+		e = bsearch(&key, tab, n, sizeof(*tab), hash_cmp);
+		if (!e) continue;
+		// bsearch may return any of the equal entries
+		while (e > tab && !hash_cmp(e - 1, &key)) e--;
+		res_name(job, job->first + i, name, sizeof(name));
+		for (; e < tab + n && !hash_cmp(e, &key); e++)
+			if (!strcmp(e->name, name)) break;
+		if (e == tab + n || hash_cmp(e, &key)) continue;
+		// the file may be deleted or truncated since
+		if (check) {
+			struct stat st;
+			if (stat(name, &st) || !S_ISREG(st.st_mode) ||
+					(unsigned long)st.st_size != res_out_size(job, job->first + i)) continue;
+		}
+		info->skip = 1;
+	}
+	for (i = 0; i < n; i++) free(tab[i].name);
+	free(tab);
+}
+
+static int res_manifest(job_t *job, const char *fn) {
+	FILE *f = fopen(fn, "w");
+	unsigned i, addr, size;
+	char name[256];
+	if (!f) return 1;
+	fprintf(f, "# index addr size type width height hash file\n");
+	for (i = 0; i < job->count; i++) {
+		res_info_t *info = &job->info[i];
+		unsigned w, h;
+		res_range(job, job->first + i, &addr, &size);
+		res_dims(job, job->first + i, &w, &h);
+		strcpy(name, "-");
+		if (!job->info[info->dup].failed) {
+			if (job->atlas_of && job->atlas_of[info->dup] >= 0)
+				snprintf(name, sizeof(name), "%s%u.ppm", job->atlas, job->atlas_of[info->dup]);
+			else
+				res_name(job, job->first + info->dup, name, sizeof(name));
+		}
+		fprintf(f, "%u 0x%06x %u %s %u %u %016llx %s\n", job->first + i, addr, size,
+				type_names[info->type], w, h, (unsigned long long)info->hash, name);
+	}
+	return fclose(f) != 0;
+}
+
+/* called from the main thread in the order of the resources */
+static const char* tar_write(job_t *job, unsigned i) {
+	out_t *out = &job->tar_out[i - job->first];
+	uint8_t *data = out->data;
+	char name[256]; unsigned addr, size;
+	const char *err;
+
+	if (!out->size) return NULL;
+	if (!data) {
+		// not copied by out_write
+		res_range(job, i, &addr, &size);
+		data = job->rom + addr;
+	}
+	res_name(job, i, name, sizeof(name));
+	err = put_file(job, name, data, out->size);
+	free(out->data);
+	out->data = NULL; out->size = 0;
+	return err;
+}
+
+static void* extract_thread(void *arg) {
+	job_t *job = arg;
+	for (;;) {
+		unsigned i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+		const char *err;
+		if (i >= job->count || __atomic_load_n(&job->quit, __ATOMIC_RELAXED)) break;
+		err = extract_res(job, job->first + i);
+		pthread_mutex_lock(&job->lock);
+		job->err[i] = err;
+		job->done[i] = 1;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+	}
+	return NULL;
+}
+
+/* returns non-zero to stop */
+static int report_res(job_t *job, unsigned i, const char *err) {
+	unsigned addr, size;
+	if (!err) return 0;
+	if (err == err_create || err == err_tar) {
+		fprintf(job->log, "%s\n", err);
+		return 1;
+	}
+	if (job->info) job->info[i - job->first].failed = 1;
+	res_range(job, i, &addr, &size);
+	fprintf(job->log, "unpack_image failed (%s)\n", err);
+	fprintf(job->log, "error at res%u (addr = 0x%x)\n", i, addr);
+	return 0;
+}
+
+#define ATLAS_W 1024
+#define ATLAS_H 1024
+
+typedef struct {
+	unsigned idx, w, h, x, y, atlas;
+} rect_t;
+
+static int rect_cmp(const void *a, const void *b) {
+	const rect_t *x = a, *y = b;
+	if (x->h != y->h) return x->h > y->h ? -1 : 1;
+	if (x->w != y->w) return x->w > y->w ? -1 : 1;
+	return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+/* Packs the decoded images into atlases with a shelf packer, */
+/* the images are sorted by height so the shelves waste little space. */
+/* The index has one line per image: resource, atlas, x, y, w, h. */
+
+static const char* atlas_write(job_t *job) {
+	unsigned i, j, n = 0, natlas = 0, x = 0, y = 0, shelf = 0;
+	unsigned *heights, *pos;
+	rect_t *rects, *r;
+	char name[256], *index, *d;
+	const char *err = NULL;
+
+	rects = malloc((job->count + 1) * sizeof(*rects));
+	pos = malloc((job->count + 1) * sizeof(*pos));
+	heights = malloc((job->count + 1) * sizeof(*heights));
+	job->atlas_of = malloc((job->count + 1) * sizeof(*job->atlas_of));
+	if (!rects || !pos || !heights || !job->atlas_of) ERR_EXIT("malloc failed\n");
+	for (i = 0; i < job->count; i++) {
+		job->atlas_of[i] = -1;
+		if (!job->atlas_out[i].data) continue;
+		r = &rects[n++];
+		r->idx = i;
+		res_dims(job, job->first + i, &r->w, &r->h);
+	}
+	qsort(rects, n, sizeof(*rects), rect_cmp);
+
+	heights[0] = 0;
+	for (r = rects; r < rects + n; r++) {
+		if (x + r->w > ATLAS_W) {
+			y += shelf; x = shelf = 0;
+		}
+		if (y + r->h > ATLAS_H) {
+			heights[++natlas] = 0;
+			x = y = shelf = 0;
+		}
+		r->x = x; r->y = y; r->atlas = natlas;
+		x += r->w;
+		if (shelf < r->h) shelf = r->h;
+		if (heights[natlas] < y + r->h) heights[natlas] = y + r->h;
+		job->atlas_of[r->idx] = natlas;
+		pos[r->idx] = r - rects;
+	}
+	if (n) natlas++;
+
+	// the rects are already in the atlas order
+	for (j = 0, r = rects; j < natlas && !err; j++) {
+		size_t size = ATLAS_W * heights[j] * 3;
+		uint8_t *buf = calloc(32 + size, 1), *p;
+		if (!buf) ERR_EXIT("malloc failed\n");
+		p = buf + sprintf((char*)buf, "P6\n%u %u\n255\n", ATLAS_W, heights[j]);
+		for (; r < rects + n && r->atlas == j; r++) {
+			out_t *out = &job->atlas_out[r->idx];
+			uint8_t *s = out->data, *d = p + (r->y * ATLAS_W + r->x) * 3;
+			if (s[1] == '1') {
+				// PBM, the digits are converted to black and white
+				s += out->size - (r->w + 1) * r->h;
+				for (y = 0; y < r->h; y++, s += r->w + 1, d += ATLAS_W * 3)
+					for (x = 0; x < r->w; x++)
+						memset(d + x * 3, s[x] == '1' ? 0 : 255, 3);
+			} else {
+				s += out->size - r->w * r->h * 3;
+				for (y = 0; y < r->h; y++, s += r->w * 3, d += ATLAS_W * 3)
+					memcpy(d, s, r->w * 3);
+			}
+		}
+		snprintf(name, sizeof(name), "%s%u.ppm", job->atlas, j);
+		err = put_file(job, name, buf, p - buf + size);
+		free(buf);
+	}
+
+	// the copies found by the manifest point to the first image
+	if (!err) {
+		index = d = malloc(32 + job->count * 64);
+		if (!index) ERR_EXIT("malloc failed\n");
+		d += sprintf(d, "# index atlas x y w h\n");
+		for (i = 0; i < job->count; i++) {
+			j = job->info ? job->info[i].dup : i;
+			if (job->atlas_of[j] < 0) continue;
+			r = &rects[pos[j]];
+			d += sprintf(d, "%u %u %u %u %u %u\n", job->first + i,
+					r->atlas, r->x, r->y, r->w, r->h);
+		}
+		snprintf(name, sizeof(name), "%s.txt", job->atlas);
+		err = put_file(job, name, (uint8_t*)index, d - index);
+		free(index);
+	}
+	free(heights);
+	free(pos);
+	free(rects);
+	return err;
+}
+
 int main(int argc, char **argv) {
 	size_t rom_size = 0; uint8_t *rom, *p;
 	unsigned i, res_tab, end; int res_idx = -1;
-	const char *rom_fn, *out_fn = "res";
-	sysctx_t sys;
+	const char *rom_fn, *out_fn = "res", *tar_fn = NULL;
+	const char *manifest_fn = NULL, *prev_fn = NULL, *atlas = NULL;
+	sysctx_t sys; job_t job;
+	int ret = 0, nthreads = 1, progress = 0, tar_err = 0;
+	pthread_t *threads;
+
+	while (argc > 1 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-j")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			nthreads = atoi(argv[2]);
+			if (nthreads < 1) nthreads = 1;
+			if (nthreads > 256) nthreads = 256;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-t")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			tar_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-m")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			manifest_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-p")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			prev_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-a")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			atlas = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "-v")) {
+			progress = 256;
+			argc -= 1; argv += 1;
+		} else ERR_EXIT("unknown option\n");
+	}
 
 	if (argc < 2) {
-		printf("Usage: resextract flash.bin [path/name] [index]\n");
+		printf("Usage: resextract [-j threads] [-t out.tar] [-m manifest] [-p prev_manifest] [-a atlas] [-v] flash.bin [path/name] [index]\n");
 		return 0;
 	}
 	rom_fn = argv[1];
@@ -296,7 +791,7 @@ int main(int argc, char **argv) {
 		if (res_idx >> 24) return 1;
 	}
 
-	rom = loadfile(rom_fn, &rom_size, 8 << 20);
+	rom = mapfile(rom_fn, &rom_size, 8 << 20);
 	if (!rom) ERR_EXIT("loading ROM failed\n");
 
 	sys.rom = rom;
@@ -311,6 +806,12 @@ int main(int argc, char **argv) {
 		p[0] = curve_r[i >> 5 & 7];
 		p[1] = curve_g[i >> 2 & 7];
 		p[2] = curve_b[i & 3];
+		memcpy(&pal32[i], p, 3);
+	}
+	{
+		// initializes the tables before the threads start
+		adpcm_status_t adpcm;
+		adpcm_init(&adpcm);
 	}
 
 	res_tab = READ24(rom);
@@ -321,48 +822,124 @@ int main(int argc, char **argv) {
 		i = res_idx;
 		if (end > i * 3) end = i * 3 + 1;
 	}
+	// checks the table first, so the entries can be processed in any order
+	job.first = i;
 	for (; i * 3 < end; i++) {
-		const char * const ext[] = { "bin", "ppm", "wav", "pbm" };
-		char name[256]; int type = 0;
 		unsigned addr = READ24(rom + res_tab + i * 3);
 		unsigned next = READ24(rom + res_tab + i * 3 + 3);
-		unsigned res_size;
 		if (next == 0xffffff) next = res_tab;
-		if (addr >= next) return 1;
-		if (next > rom_size) return 1;
-		res_size = next - addr;
-		if (res_size >= 4) {
-			if (rom[addr + 3] == 0x80 && rom[addr + 1] == 0) type = 1;
-#if 1
-			else if (rom[addr] == 0x81) type = 2;
-#endif
-			else {
-				int w = rom[addr], h = rom[addr + 1];
-				int st = (w + 7) >> 3;
-				if (w <= 0x80 && h <= 0x80 && res_size == st * h + 2) type = 3;
-			}
+		if (addr >= next || next > rom_size) { ret = 1; break; }
+	}
+	job.count = i - job.first;
+	job.rom = rom;
+	job.rom_size = rom_size;
+	job.res_tab = res_tab;
+	job.out_fn = out_fn;
+	job.single = res_idx >= 0;
+	job.next = job.quit = 0;
+	job.tar = NULL;
+	job.log = stdout;
+	job.tar_out = NULL;
+	job.info = NULL;
+	job.atlas = atlas;
+	job.atlas_out = NULL;
+	job.atlas_of = NULL;
+	if (atlas) {
+		// an atlas only has the images of this run
+		if (prev_fn) ERR_EXIT("-a can't be used with -p\n");
+		job.atlas_out = calloc(job.count + 1, sizeof(*job.atlas_out));
+		if (!job.atlas_out) ERR_EXIT("malloc failed\n");
+	}
+
+	// the duplicates are only skipped when the manifest tells where they are
+	if (manifest_fn || prev_fn) res_hash(&job);
+	if (prev_fn) res_prev(&job, prev_fn, !tar_fn);
+
+	if (tar_fn) {
+		// the messages go to stderr when the archive is on stdout
+		if (!strcmp(tar_fn, "-")) {
+			job.tar = stdout;
+			job.log = stderr;
+		} else job.tar = fopen(tar_fn, "wb");
+		if (!job.tar) ERR_EXIT("can't create archive\n");
+		job.tar_out = calloc(job.count + 1, sizeof(*job.tar_out));
+		if (!job.tar_out) ERR_EXIT("malloc failed\n");
+	}
+
+	if (nthreads <= 1 || job.count <= 1) {
+		for (i = 0; i < job.count; i++) {
+			unsigned k = job.first + i;
+			if (report_res(&job, k, extract_res(&job, k))) { job.quit = 1; break; }
+			if (job.tar && report_res(&job, k, tar_write(&job, k))) { job.quit = tar_err = 1; break; }
+			if (progress && ((i + 1) % progress == 0 || i + 1 == job.count))
+				fprintf(stderr, "%u/%u\n", i + 1, job.count);
 		}
+		goto end;
+	}
 
-		if (res_idx >= 0)
-			snprintf(name, sizeof(name), "%s.%s", out_fn, ext[type]);
-		else
-			snprintf(name, sizeof(name), "%s%u.%s", out_fn, i, ext[type]);
-
-		if (type == 1) {
-			int ret = decode_image(rom + addr, res_size, name);
-			if (ret) printf("error at res%u (addr = 0x%x)\n", i, addr);
-		} else if (type == 2) {
-			decode_sound(rom + addr, res_size, name);
-		} else if (type == 3) {
-			int ret = decode_image_1bit(rom + addr, res_size, name);
-			if (ret) printf("error at res%u (addr = 0x%x)\n", i, addr);
-		} else {
-			FILE *f = fopen(name, "wb");
-			if (!f) break;
-			fwrite(rom + addr, 1, res_size, f);
-			fclose(f);
+	threads = malloc(nthreads * sizeof(*threads));
+	job.err = malloc(job.count * sizeof(*job.err));
+	job.done = calloc(job.count, 1);
+	if (!threads || !job.err || !job.done) ERR_EXIT("malloc failed\n");
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_cond_init(&job.cond, NULL);
+	for (i = 0; i < (unsigned)nthreads; i++)
+		if (pthread_create(&threads[i], NULL, extract_thread, &job))
+			ERR_EXIT("pthread_create failed\n");
+
+	// the messages are printed in the order of the resources
+	for (i = 0; i < job.count; i++) {
+		const char *err;
+		pthread_mutex_lock(&job.lock);
+		while (!job.done[i]) pthread_cond_wait(&job.cond, &job.lock);
+		err = job.err[i];
+		pthread_mutex_unlock(&job.lock);
+		if (report_res(&job, job.first + i, err) ||
+				(job.tar && report_res(&job, job.first + i, tar_write(&job, job.first + i)) && (tar_err = 1))) {
+			__atomic_store_n(&job.quit, 1, __ATOMIC_RELAXED);
+			break;
 		}
+		if (progress && ((i + 1) % progress == 0 || i + 1 == job.count))
+			fprintf(stderr, "%u/%u\n", i + 1, job.count);
 	}
-	return 0;
+	for (i = 0; i < (unsigned)nthreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.lock);
+	pthread_cond_destroy(&job.cond);
+	free(threads);
+	free(job.err);
+	free(job.done);
+end:
+	if (atlas) {
+		if (!job.quit && report_res(&job, 0, atlas_write(&job))) {
+			job.quit = 1;
+			if (job.tar) tar_err = 1;
+		}
+		for (i = 0; i < job.count; i++) free(job.atlas_out[i].data);
+		free(job.atlas_out);
+	}
+	// not written after a fatal error, so the next run extracts everything
+	if (manifest_fn && !job.quit && res_manifest(&job, manifest_fn)) {
+		fprintf(job.log, "can't write manifest\n");
+		ret = 1;
+	}
+	free(job.info);
+	free(job.atlas_of);
+	if (job.tar) {
+		// the entries left after an error are freed here
+		for (i = 0; i < job.count; i++) free(job.tar_out[i].data);
+		free(job.tar_out);
+		if (!tar_err) {
+			static const uint8_t zero[1024];
+			if (fwrite(zero, 1, sizeof(zero), job.tar) != sizeof(zero) ||
+					fflush(job.tar)) {
+				fprintf(job.log, "%s\n", err_tar);
+				tar_err = 1;
+			}
+		}
+		if (job.tar != stdout) fclose(job.tar);
+		if (tar_err) ret = 1;
+	}
+	unmapfile(rom, rom_size);
+	return ret;
 }
-
@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2024, Ilya Kurdyukov
+ *
+ * Permission to use, copy, modify, and/or distribute this software for
+ * any purpose with or without fee is hereby granted.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL
+ * WARRANTIES WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY
+ * DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+*/
+
+/* Generates a synthetic firmware image for testing and benchmarks. */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ERR_EXIT(...) do { \
+	fprintf(stderr, __VA_ARGS__); exit(1); \
+} while (0)
+
+#define WRITE16(p, a) do { unsigned __tmp = (a); \
+	(p)[0] = __tmp; (p)[1] = __tmp >> 8; \
+} while (0)
+#define WRITE24(p, a) do { unsigned __tmp = (a); \
+	(p)[0] = __tmp; (p)[1] = __tmp >> 8; (p)[2] = __tmp >> 16; \
+} while (0)
+
+/* the frame stays under the frame skip limit of 20000 pixels */
+#define BG_H 16
+#define SPRITES 4
+
+#define CODE_OFFS 0x100
+#define FONT_OFFS 0x4000
+#define RES_OFFS 0x10000
+
+/* resource ids */
+enum {
+	RES_BG, /* 128 x BG_H */
+	RES_SPRITE, /* 8 sprites of different sizes */
+	RES_1BIT = RES_SPRITE + 8,
+	RES_VLINE, /* 1 x screen_h */
+	RES_HLINE, /* 128 x 1 */
+	RES_SOUND,
+	RES_COUNT
+};
+
+/* work RAM used by the overlays */
+#define V_FRAME 0x200
+#define V_IDX 0x202
+#define V_LOOP 0x203
+#define V_TABLE 0x240
+#define Z_RND 0xc0
+
+static uint8_t *rom;
+static unsigned rom_size, screen_h, res_pos;
+static unsigned res_addr[RES_COUNT];
+static uint32_t seed = 1;
+
+static unsigned rnd(void) {
+	seed = seed * 1103515245 + 12345;
+	return seed >> 16;
+}
+
+/* RLE line: total length, data, total length */
+static unsigned rle_line(uint8_t *d, const uint8_t *s, int w) {
+	unsigned n = 2; int x = 0;
+	while (x < w) {
+		int a = s[x], k = 1;
+		while (x + k < w && s[x + k] == a && k < 255) k++;
+		if (a && k < 3) {
+			d[n++] = a; x++;
+		} else {
+			d[n++] = 0; d[n++] = a; d[n++] = k; x += k;
+		}
+	}
+	n += 2;
+	WRITE16(d, n); WRITE16(d + n - 2, n);
+	return n;
+}
+
+static unsigned add_image(const uint8_t *pix, int w, int h) {
+	unsigned pos = res_pos; uint8_t *d = rom + pos; int y;
+	d[0] = w; d[1] = 0; d[2] = h; d[3] = 0x80; d += 4;
+	for (y = 0; y < h; y++) d += rle_line(d, pix + y * w, w);
+	res_pos = d - rom;
+	return pos;
+}
+
+static unsigned add_1bit(const uint8_t *pix, int w, int h) {
+	unsigned pos = res_pos; uint8_t *d = rom + pos; int x, y;
+	*d++ = w; *d++ = h;
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x += 8, d++) {
+			int i, a = 0;
+			for (i = 0; i < 8; i++)
+				a = a << 1 | (x + i < w && pix[y * w + x + i]);
+			*d = a;
+		}
+	}
+	res_pos = d - rom;
+	return pos;
+}
+
+static void gen_resources(void) {
+	static uint8_t pix[128 * 160];
+	int i, x, y, w, h;
+
+	res_pos = RES_OFFS;
+	/* background with long runs and some noise */
+	for (y = 0; y < BG_H; y++)
+	for (x = 0; x < 128; x++)
+		pix[y * 128 + x] = (y >> 3) * 0x24 + (x >> 5) + ((rnd() & 31) ? 0 : 0x40);
+	res_addr[RES_BG] = add_image(pix, 128, BG_H);
+
+	/* round sprites, 0xff is transparent */
+	for (i = 0; i < 8; i++) {
+		int r2;
+		w = h = 8 + i * 8;
+		if (i & 1) h -= 4;
+		r2 = (w / 2) * (w / 2);
+		for (y = 0; y < h; y++)
+		for (x = 0; x < w; x++) {
+			int dx = x * 2 - w + 1, dy = y * 2 - h + 1, a = 0xff;
+			if (dx * dx + dy * dy <= r2 * 4)
+				a = (i * 0x25 + (dx * dy > 0 ? 0x11 : 0x80) + (x & y & 4)) & 0xfe;
+			pix[y * w + x] = a;
+		}
+		res_addr[RES_SPRITE + i] = add_image(pix, w, h);
+	}
+
+	w = 32; h = 24;
+	for (y = 0; y < h; y++)
+	for (x = 0; x < w; x++)
+		pix[y * w + x] = ((x ^ y) & 8) != 0;
+	res_addr[RES_1BIT] = add_1bit(pix, w, h);
+
+	for (y = 0; y < (int)screen_h; y++) pix[y] = y * 3;
+	res_addr[RES_VLINE] = add_image(pix, 1, screen_h);
+	for (x = 0; x < 128; x++) pix[x] = 0xe0 | (x >> 4);
+	res_addr[RES_HLINE] = add_image(pix, 128, 1);
+
+	/* 4-bit ADPCM, the first byte is the type */
+	res_addr[RES_SOUND] = res_pos;
+	rom[res_pos++] = 0x81;
+	for (i = 0; i < 2000; i++) rom[res_pos++] = rnd();
+}
+
+static void gen_font(void) {
+	uint8_t *d = rom + FONT_OFFS; int i, y;
+	for (i = 0x20; i < 0x80; i++)
+	for (y = 0; y < 16; y++) {
+		int a = 0;
+		if (i > 0x20 && y >= 2 && y < 14) {
+			a = (i * 0x9d >> (y & 3)) & 0x7e;
+			if (y == 2 || y == 13) a |= 0x3c;
+		}
+		*d++ = a;
+	}
+}
+
+/* a tiny 65C02 assembler */
+
+static uint8_t *asm_p;
+static unsigned asm_start;
+
+#define OFFS ((unsigned)(asm_p - rom))
+#define ADDR(o) (0x300 + (o) - asm_start)
+#define PC ADDR(OFFS)
+
+/* forward references */
+#define PATCH16(o, a) WRITE16(rom + (o) + 1, a)
+#define RESOLVE(o) (rom[(o) + 1] = PC - ADDR(o) - 2)
+
+static void op1(unsigned op) { *asm_p++ = op; }
+static void op2(unsigned op, unsigned a) { op1(op); op1(a & 0xff); }
+static void op3(unsigned op, unsigned a) { op2(op, a); op1(a >> 8 & 0xff); }
+
+#define OP1(op) op1(op)
+#define OP2(op, a) op2(op, a)
+#define OP3(op, a) op3(op, a)
+
+#define LDA_I(a) OP2(0xa9, a)
+#define LDA_Z(a) OP2(0xa5, a)
+#define LDA_A(a) OP3(0xad, a)
+#define LDA_AX(a) OP3(0xbd, a)
+#define LDX_I(a) OP2(0xa2, a)
+#define LDY_I(a) OP2(0xa0, a)
+#define STA_Z(a) OP2(0x85, a)
+#define STA_A(a) OP3(0x8d, a)
+#define STA_AX(a) OP3(0x9d, a)
+#define STZ_Z(a) OP2(0x64, a)
+#define STZ_A(a) OP3(0x9c, a)
+#define ADC_I(a) OP2(0x69, a)
+#define ADC_Z(a) OP2(0x65, a)
+#define ADC_A(a) OP3(0x6d, a)
+#define AND_I(a) OP2(0x29, a)
+#define ORA_I(a) OP2(0x09, a)
+#define EOR_I(a) OP2(0x49, a)
+#define CMP_I(a) OP2(0xc9, a)
+#define CPX_I(a) OP2(0xe0, a)
+#define INC_A(a) OP3(0xee, a)
+#define DEC_A(a) OP3(0xce, a)
+#define ROL_Z(a) OP2(0x26, a)
+#define JSR(a) OP3(0x20, a)
+#define JMP(a) OP3(0x4c, a)
+#define ASL OP1(0x0a)
+#define LSR OP1(0x4a)
+#define ROL OP1(0x2a)
+#define CLC OP1(0x18)
+#define SED OP1(0xf8)
+#define CLD OP1(0xd8)
+#define PHA OP1(0x48)
+#define PLA OP1(0x68)
+#define PHX OP1(0xda)
+#define PLX OP1(0xfa)
+#define INX OP1(0xe8)
+#define DEX OP1(0xca)
+#define DEY OP1(0x88)
+#define TAX OP1(0xaa)
+#define TXA OP1(0x8a)
+#define TYA OP1(0x98)
+#define RTS OP1(0x60)
+
+#define BNE(l) OP2(0xd0, (l) - PC - 2)
+#define BCC(l) OP2(0x90, (l) - PC - 2)
+
+static void asm_begin(unsigned offs) {
+	asm_start = offs;
+	asm_p = rom + offs;
+}
+
+static unsigned asm_end(unsigned entry) {
+	unsigned size = (OFFS - asm_start + 1) & ~1;
+	if (size >= 0x500) ERR_EXIT("overlay is too big\n");
+	if (entry) {
+		WRITE16(rom + entry, asm_start);
+		WRITE16(rom + entry + 2, size >> 1);
+	}
+	return size;
+}
+
+#define SETRES(mem, id) (LDA_I(id), STA_A(mem), STZ_A(mem + 1))
+#define SETADDR(addr) (LDA_I((addr) & 0xff), STA_Z(0x80), \
+	LDA_I((addr) >> 8 & 0xff), STA_Z(0x81), \
+	LDA_I((addr) >> 16), STA_Z(0x82))
+#define SYSCALL(id) (LDX_I(id), JSR(0x6000))
+#define ROMCALL(addr, size, jmp) (SETADDR(addr), \
+	LDA_I((size) >> 1 & 0xff), STA_Z(0x83), \
+	LDA_I((size) >> 9), STA_Z(0x84), \
+	jmp ? JMP(0x6052) : JSR(0x60de))
+
+static void gen_code(void) {
+	static const char text[] = "TOUMAPET 0123";
+	unsigned sub1, sub2, size1, size2, save = rom_size - 0x10000;
+	unsigned l1, l2, l3, loop, f1, f2, i, n;
+	unsigned fstart[3], fbyte[13];
+
+	/* sub2: draws the text */
+	sub2 = CODE_OFFS + 0x1800;
+	asm_begin(sub2);
+	LDX_I(0);
+	loop = PC;
+	TXA; ASL; ASL; ASL; CLC; ADC_I(4); STA_A(0x100);
+	STZ_A(0x101);
+	f1 = OFFS; LDA_AX(0); STA_A(0x102);
+	LDA_A(V_FRAME); STA_A(0x103);
+	STZ_A(0x104);
+	PHX; SYSCALL(0x26); PLX;
+	INX; CPX_I(sizeof(text) - 1); BNE(loop);
+	/* the same string with transparent background */
+	LDX_I(0);
+	loop = PC;
+	TXA; ASL; ASL; ASL; STA_A(0x100);
+	LDA_I(20); STA_A(0x101);
+	f2 = OFFS; LDA_AX(0); STA_A(0x102);
+	LDA_I(0xfc); STA_A(0x103);
+	PHX; SYSCALL(0x24); PLX;
+	INX; CPX_I(sizeof(text) - 1); BNE(loop);
+	RTS;
+	PATCH16(f1, PC); PATCH16(f2, PC);
+	memcpy(asm_p, text, sizeof(text) - 1);
+	asm_p += sizeof(text) - 1;
+	size2 = asm_end(0);
+
+	/* sub1: computational loop, then a tail call to sub2 */
+	sub1 = CODE_OFFS + 0x1000;
+	asm_begin(sub1);
+	LDA_I(24); STA_A(V_LOOP);
+	loop = PC;
+	LDY_I(0);
+	l1 = PC;
+	LDA_Z(Z_RND); ASL; ROL_Z(Z_RND + 1);
+	l2 = OFFS; BCC(0); EOR_I(0x2d); RESOLVE(l2);
+	STA_Z(Z_RND);
+	CLC; ADC_Z(Z_RND + 2); STA_Z(Z_RND + 2);
+	SED; LDA_Z(Z_RND + 3); ADC_I(1); STA_Z(Z_RND + 3); CLD;
+	PHA; TYA; AND_I(0x3f); TAX; PLA; STA_AX(V_TABLE);
+	DEY; BNE(l1);
+	DEC_A(V_LOOP); BNE(loop);
+	/* reads the save area */
+	SETADDR(save); JSR(0x6003);
+	ROMCALL(sub2, size2, 1);
+	size1 = asm_end(0);
+
+	/* init */
+	asm_begin(CODE_OFFS);
+	STZ_A(V_FRAME); LDA_I(1); STA_Z(Z_RND);
+	STZ_A(0x100); LDA_I(screen_h - 1); STA_A(0x101); STZ_A(0x102);
+	SYSCALL(0x0c);
+	RTS;
+	asm_end(3);
+
+	/* frame */
+	asm_begin(CODE_OFFS + 0x100);
+	INC_A(V_FRAME);
+	/* clear the bottom lines */
+	LDA_I(screen_h - 8); STA_A(0x100); LDA_I(screen_h - 1); STA_A(0x101);
+	LDA_A(V_FRAME); STA_A(0x102);
+	SYSCALL(0x0c);
+	/* background */
+	STZ_A(0x100); STZ_A(0x101); SETRES(0x102, RES_BG);
+	STZ_A(0x104); SYSCALL(0x0a);
+	/* sprites, odd ones are blended, the sizes alternate each frame */
+	STZ_A(V_IDX);
+	loop = PC;
+	LDA_A(V_IDX); ASL; ASL; ASL; ASL; ASL; CLC; ADC_A(V_FRAME); STA_A(0x100);
+	LDA_A(V_IDX); ASL; ASL; ASL; CLC; ADC_A(V_FRAME); LSR; STA_A(0x101);
+	LDA_A(V_FRAME); LSR; LDA_A(V_IDX); ROL; CLC; ADC_I(RES_SPRITE); STA_A(0x102); STZ_A(0x103);
+	LDA_A(V_IDX); AND_I(3); STA_A(0x104);
+	LDA_I(0x49); STA_A(0x105);
+	LDA_A(V_IDX); LSR;
+	LDX_I(0x0a);
+	l1 = OFFS; BCC(0); LDX_I(0x08); RESOLVE(l1);
+	JSR(0x6000);
+	INC_A(V_IDX); LDA_A(V_IDX); CMP_I(SPRITES); BNE(loop);
+	/* 1-bit image */
+	LDA_A(V_FRAME); STA_A(0x100); LDA_I(40); STA_A(0x101);
+	SETRES(0x102, RES_1BIT); LDA_I(4); STA_A(0x104);
+	LDA_I(0xe0); STA_A(0x105); SYSCALL(0x08);
+	/* image size */
+	SETRES(0x100, RES_SPRITE + 3); SYSCALL(0x06);
+	/* repeat lines */
+	LDA_I(100); STA_A(0x100); LDA_I(110); STA_A(0x101);
+	SETRES(0x102, RES_VLINE); SYSCALL(0x0e);
+	LDA_I(screen_h - 8); STA_A(0x100); LDA_I(screen_h - 1); STA_A(0x101);
+	SETRES(0x102, RES_HLINE); SYSCALL(0x0e);
+	/* intersection check */
+	LDA_A(V_FRAME); STA_A(0x100); LDA_I(30); STA_A(0x101);
+	SETRES(0x102, RES_SPRITE); STZ_A(0x104);
+	LDA_I(50); STA_A(0x105); LDA_I(36); STA_A(0x106);
+	SETRES(0x107, RES_SPRITE + 1); LDA_I(1); STA_A(0x109);
+	SYSCALL(0x10);
+	/* sounds */
+	SETADDR(res_addr[RES_SOUND]); STZ_Z(0x85); SYSCALL(0x14);
+	SETRES(0x80, RES_SOUND); STZ_Z(0x82); SYSCALL(0x1c);
+	/* the flash is written every 16 frames */
+	LDA_A(V_FRAME); AND_I(15);
+	l2 = OFFS; BNE(0);
+	n = 0;
+	fstart[0] = OFFS; JSR(0);
+	LDA_I(0x06); fbyte[n++] = OFFS; JSR(0);
+	LDA_A(V_FRAME);
+	l3 = OFFS; BNE(0);
+	/* sector erase every 256 frames */
+	fstart[1] = OFFS; JSR(0);
+	LDA_I(0x20); fbyte[n++] = OFFS; JSR(0);
+	LDA_I(save >> 16); fbyte[n++] = OFFS; JSR(0);
+	LDA_I(save >> 8 & 0xff); fbyte[n++] = OFFS; JSR(0);
+	LDA_I(0); fbyte[n++] = OFFS; JSR(0);
+	fstart[2] = OFFS; JSR(0);
+	LDA_I(0x06); fbyte[n++] = OFFS; JSR(0);
+	RESOLVE(l3);
+	/* page program */
+	f1 = OFFS; JSR(0);
+	LDA_I(0x02); fbyte[n++] = OFFS; JSR(0);
+	LDA_I(save >> 16); fbyte[n++] = OFFS; JSR(0);
+	LDA_I(save >> 8 & 0xff); fbyte[n++] = OFFS; JSR(0);
+	LDA_A(V_FRAME); fbyte[n++] = OFFS; JSR(0);
+	LDA_A(V_FRAME); fbyte[n++] = OFFS; JSR(0);
+	LDA_I(1); STA_Z(0x12);
+	RESOLVE(l2);
+	/* polls the keys */
+	LDA_Z(0x00);
+	ROMCALL(sub1, size1, 0);
+	RTS;
+
+	/* starts a flash command */
+	for (i = 0; i < 3; i++) PATCH16(fstart[i], PC);
+	PATCH16(f1, PC);
+	LDA_I(1); STA_Z(0x12); STZ_Z(0x12); STZ_Z(0x02);
+	RTS;
+
+	/* sends a byte to the flash, each bit is sent twice */
+	for (i = 0; i < n; i++) PATCH16(fbyte[i], PC);
+	LDX_I(8);
+	loop = PC;
+	ASL; PHA; LDA_I(0); ROL; ASL; ASL;
+	ORA_I(2); STA_Z(0x02); ORA_I(1); STA_Z(0x02);
+	PLA; DEX; BNE(loop);
+	RTS;
+	asm_end(0x1b);
+}
+
+int main(int argc, char **argv) {
+	const char *fn; FILE *f;
+	unsigned i, res_tab, key = 0x5a, size_mb = 4;
+
+	if (argc < 2) {
+		printf("Usage: romgen out.bin [size_mb] [key]\n");
+		return 0;
+	}
+	fn = argv[1];
+	if (argc > 2) size_mb = strtol(argv[2], NULL, 0);
+	if (argc > 3) key = strtol(argv[3], NULL, 0) & 0xff;
+	// sizes are the same as used to detect the model
+	if (size_mb != 2 && size_mb != 4 && size_mb != 8)
+		ERR_EXIT("unsupported ROM size\n");
+	rom_size = size_mb << 20;
+	screen_h = size_mb == 8 ? 160 : 128;
+
+	rom = malloc(rom_size);
+	if (!rom) ERR_EXIT("malloc failed\n");
+	memset(rom, 0xff, rom_size);
+	memcpy(rom + 0x23, "tony", 4);
+
+	WRITE16(rom + 7, FONT_OFFS);
+	gen_font();
+	gen_resources();
+	gen_code();
+
+	res_tab = res_pos;
+	WRITE24(rom, res_tab);
+	for (i = 0; i < RES_COUNT; i++)
+		WRITE24(rom + res_tab + i * 3, res_addr[i]);
+	// the table ends with 0xffffff
+	if (res_tab + RES_COUNT * 3 + 3 > rom_size - 0x10000)
+		ERR_EXIT("resources don't fit\n");
+
+	for (i = 0; i < rom_size; i++) rom[i] ^= key;
+
+	f = fopen(fn, "wb");
+	if (!f) ERR_EXIT("fopen failed\n");
+	if (fwrite(rom, 1, rom_size, f) != rom_size)
+		ERR_EXIT("fwrite failed\n");
+	fclose(f);
+	free(rom);
+	return 0;
+}
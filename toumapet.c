@@ -13,20 +13,63 @@
  * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
 */
 
+#ifndef _WIN32
+#define _GNU_SOURCE
+#endif
 #include "window.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <errno.h>
+#endif
 
-#ifndef CPU_TRACE
-#define CPU_TRACE 0
+/* USDT probes for perf/bpftrace, these are NOPs until attached. */
+#ifndef USE_SDT
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define USE_SDT 1
+#endif
+#endif
 #endif
 
-//#define TICK_LIMIT 1000000
+#if USE_SDT
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(toumapet, name)
+#define PROBE1(name, a) DTRACE_PROBE1(toumapet, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(toumapet, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(toumapet, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(toumapet, name, a, b, c, d)
+#else
+#define PROBE0(name) (void)0
+#define PROBE1(name, a) (void)0
+#define PROBE2(name, a, b) (void)0
+#define PROBE3(name, a, b, c) (void)0
+#define PROBE4(name, a, b, c, d) (void)0
+#endif
 
+/* The daemon catches the errors of an instance with err_jmp. */
 #define ERR_EXIT(...) do { \
+	if (err_jmp) { \
+		snprintf(err_msg, sizeof(err_msg), __VA_ARGS__); \
+		longjmp(*err_jmp, 1); \
+	} \
 	if (glob_sys) sys_close(glob_sys); \
 	fprintf(stderr, __VA_ARGS__); \
 	exit(1); \
@@ -53,6 +96,22 @@ typedef struct {
 	uint32_t addr; uint16_t size, type;
 } frame_t;
 
+typedef struct {
+	uint16_t pc;
+	uint8_t a, x, y, sp;
+	uint8_t flags, dummy;
+	uint8_t mem[0x10000];
+} cpu_state_t;
+
+#define READ16(p) ((p)[0] | (p)[1] << 8)
+#define READ24(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16)
+#define WRITE16(p, a) do { unsigned __tmp = (a); \
+	(p)[0] = __tmp; (p)[1] = __tmp >> 8; \
+} while (0)
+#define WRITE24(p, a) do { unsigned __tmp = (a); \
+	(p)[0] = __tmp; (p)[1] = __tmp >> 8; (p)[2] = __tmp >> 16; \
+} while (0)
+
 #define SCREEN_W 128
 // OK-550: 128, OK-560: 160
 #define SCREEN_H_MAX 160
@@ -64,6 +123,23 @@ typedef struct {
 } flash_t;
 
 typedef struct {
+	uint32_t disp_time, last_time, frames;
+	uint32_t frame_skip, frame_count, skipped;
+} game_state_t;
+
+typedef struct sysctx sysctx_t;
+typedef void run_emu_t(sysctx_t *sys, cpu_state_t *s);
+typedef struct prof prof_t;
+typedef struct timeline timeline_t;
+typedef struct metrics metrics_t;
+typedef struct shm_screen shm_screen_t;
+typedef struct video video_t;
+typedef struct vpipe vpipe_t;
+typedef struct replay replay_t;
+typedef struct coverage coverage_t;
+typedef struct lockstep lockstep_t;
+
+struct sysctx {
 	uint8_t *rom;
 	uint32_t rom_size, save_offs;
 	uint8_t rom_key, init_done, frame_depth;
@@ -71,23 +147,46 @@ typedef struct {
 	flash_t flash;
 	unsigned zoom, keys, model, screen_h;
 	unsigned pixels_count;
+	run_emu_t *run_emu;
+	uint64_t insn_count, tick_limit;
+	uint8_t flash_trace;
+	prof_t *prof;
+	timeline_t *timeline;
+	metrics_t *metrics;
+	shm_screen_t *shm_screen;
+	video_t *video;
+	vpipe_t *vpipe;
+	coverage_t *cover;
+	lockstep_t *lockstep;
+	replay_t *replay;
+	uint8_t frame_input; /* input only read between frames */
+	uint8_t headless, turbo, bench;
+	uint32_t vclock, frame_limit;
+	uint64_t bios_count[0x30 >> 1];
+	uint32_t flash_writes, flash_erases;
 	window_t window;
 #if !USE_SDL && defined(_WIN32)
 	double time_mul;
 #endif
-#if CPU_TRACE
 	char *log_buf;
 	unsigned log_pos, log_size, log_overflow;
 	const char *log_fn;
-#endif
 	frame_t frame_stack[FRAME_STACK_MAX];
+	game_state_t game;
 	uint32_t pal[256];
 	uint8_t screen[SCREEN_W * SCREEN_H_MAX];
-} sysctx_t;
+};
 
 static sysctx_t *glob_sys = NULL;
+static jmp_buf *err_jmp = NULL;
+static char err_msg[256];
+static void sys_close(sysctx_t *sys);
+static void replay_frame(sysctx_t *sys);
+static void replay_close(sysctx_t *sys);
 
 static uint32_t sys_time_ms(sysctx_t *sys) {
+	// virtual clock, advanced by the frame loop
+	if (sys->turbo) return sys->vclock;
 #if USE_SDL
 	return SDL_GetTicks();
 #elif defined(_WIN32)
@@ -101,317 +200,1201 @@ static uint32_t sys_time_ms(sysctx_t *sys) {
 #endif
 }
 
-static void sys_close(sysctx_t *sys) {
-	window_close(&sys->window);
-#if CPU_TRACE
-	if (sys->log_fn) {
-		char *buf = sys->log_buf;
-		unsigned pos = sys->log_pos;
-		unsigned size = sys->log_size;
-		unsigned pos2 = pos, n = 0;
-		FILE *f;
-		if (sys->log_overflow) {
-			do {
-				if (buf[pos2++] == '\n') break;
-				if (pos2 == size) pos2 = 0;
-			} while (pos2 != pos);
-			if (pos2 < pos) n = pos - pos2, pos = 0;
-			else n = size - pos2;
-		}
-		f = fopen(sys->log_fn, "wb");
-		if (f) {
-			fwrite(buf + pos2, 1, n, f);
-			fwrite(buf, 1, pos, f);
-			fclose(f);
-		}
-	}
+static uint64_t sys_time_us(sysctx_t *sys) {
+#if !USE_SDL && defined(_WIN32)
+	LARGE_INTEGER q;
+	QueryPerformanceCounter(&q);
+	return q.QuadPart * sys->time_mul * 1000;
+#elif defined(_WIN32)
+	return (uint64_t)SDL_GetTicks() * 1000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
 #endif
 }
 
-static void sys_init(sysctx_t *sys) {
-	int w = SCREEN_W * sys->zoom;
-	int h = sys->screen_h * sys->zoom;
-	int i, as, rs, gs, bs;
-	const char *err = window_init(&sys->window, "ToumaPet", w, h);
-	if (err) ERR_EXIT("%s\n", err);
+// the clock seen by the game, follows the frames during replays
+static uint32_t game_time_ms(sysctx_t *sys) {
+	return sys->replay ? sys->vclock : sys_time_ms(sys);
+}
 
-#if !USE_SDL && defined(_WIN32)
-	{
-		LARGE_INTEGER q;
-		QueryPerformanceFrequency(&q);
-		sys->time_mul = 1000.0 / q.QuadPart;
-	}
-#endif
+/* Frame profiler: the time of each part of a frame is collected */
+/* into histograms with 16 buckets per power of two. */
 
-	rs = sys->window.red << 3;
-	as = rs & 16 ? -8 : 8;
-	gs = rs + as; bs = gs + as;
-	as = (rs - as) & 24;
+#define HIST_SUB 16
+#define HIST_SIZE (HIST_SUB * 40)
 
-	for (i = 0; i < 256; i++) {
-		unsigned r, g, b;
-		static const uint8_t curve_r[] = { 0, 8, 24, 57, 99, 123, 214, 255 };
-		static const uint8_t curve_g[] = { 0, 12, 24, 48, 85, 125, 170, 255 };
-		static const uint8_t curve_b[] = { 0, 66, 132, 255 };
-		r = curve_r[i >> 5 & 7];
-		g = curve_g[i >> 2 & 7];
-		b = curve_b[i & 3];
-		sys->pal[i] = r << rs | g << gs | b << bs | 0xff << as;
+typedef struct {
+	uint64_t sum, min, max, count;
+	uint32_t buckets[HIST_SIZE];
+} hist_t;
+
+enum {
+	PROF_EMU, PROF_BIOS, PROF_UPDATE, PROF_PRESENT,
+	PROF_EVENT, PROF_SLEEP, PROF_FRAME,
+	PROF_INSNS, PROF_PIXELS, PROF_COUNT
+};
+
+static const char * const prof_names[PROF_COUNT] = {
+	"emu", "bios", "update", "present",
+	"event", "sleep", "frame",
+	"insns", "pixels"
+};
+
+struct prof {
+	uint64_t last, start, insns;
+	uint64_t cur[PROF_COUNT];
+	unsigned frames, skipped;
+	FILE *log;
+	hist_t hist[PROF_COUNT];
+};
+
+static volatile sig_atomic_t prof_dump_req;
+
+static void hist_add(hist_t *h, uint64_t v) {
+	unsigned i = v;
+	if (v >= HIST_SUB) {
+		unsigned e = 63 - __builtin_clzll(v) - 4;
+		i = (e + 1) * HIST_SUB + (unsigned)(v >> e) - HIST_SUB;
+		if (i >= HIST_SIZE) i = HIST_SIZE - 1;
 	}
+	h->buckets[i]++;
+	if (!h->count || h->min > v) h->min = v;
+	if (h->max < v) h->max = v;
+	h->sum += v; h->count++;
 }
 
-static void sys_update(sysctx_t *sys) {
-	uint32_t c, *d = sys->window.imagedata;
-	unsigned st = sys->window.stride >> 2;
-	uint8_t *s = sys->screen;
-	int j, x, y, w = SCREEN_W, h = sys->screen_h;
+static uint64_t hist_value(unsigned i) {
+	unsigned e;
+	if (i < HIST_SUB) return i;
+	e = i / HIST_SUB - 1;
+	return (uint64_t)(i % HIST_SUB + HIST_SUB) << e;
+}
 
-#define X d[j++] = c
-#define M(m, X) case m: \
-	for (y = 0; y < h; y++, d += st * m) { \
-		for (j = x = 0; x < w; x++) { \
-			c = sys->pal[*s++]; X; \
-		} \
-		if (m > 1) { \
-	    memcpy(d + st, d, st * 4); \
-			if (m > 2) memcpy(d + st * 2, d, st * (m < 4 ? m - 2 : 2) * 4); \
-			if (m > 4) memcpy(d + st * 4, d, st * (m - 4) * 4); \
-		} \
-	} break;
+static uint64_t hist_percentile(hist_t *h, unsigned pct) {
+	uint64_t v, n = 0, lim = (h->count * pct + 99) / 100;
+	unsigned i;
+	for (i = 0; i < HIST_SIZE; i++)
+		if ((n += h->buckets[i]) >= lim) break;
+	// the upper bound of the bucket
+	v = hist_value(i + 1) - 1;
+	if (v < h->min) v = h->min;
+	return v > h->max ? h->max : v;
+}
 
-	switch (sys->zoom) {
-		M(1, X) M(2, X;X) M(3, X;X;X)
-		M(4, X;X;X;X) M(5, X;X;X;X;X)
+static void prof_mark(sysctx_t *sys, int phase) {
+	prof_t *prof = sys->prof;
+	uint64_t t;
+	if (!prof) return;
+	t = sys_time_us(sys);
+	prof->cur[phase] += t - prof->last;
+	prof->last = t;
+}
+
+static void prof_frame(sysctx_t *sys, int skip) {
+	prof_t *prof = sys->prof;
+	uint64_t *cur = prof->cur;
+	// not collected for skipped frames
+	unsigned emu_mask = 1 << PROF_EMU | 1 << PROF_BIOS |
+			1 << PROF_INSNS | 1 << PROF_PIXELS;
+	int i;
+	// BIOS time is counted separately from emulation
+	cur[PROF_EMU] -= cur[PROF_BIOS];
+	cur[PROF_FRAME] = prof->last - prof->start;
+	cur[PROF_INSNS] = sys->insn_count - prof->insns;
+	cur[PROF_PIXELS] = skip ? 0 : sys->pixels_count;
+	for (i = 0; i < PROF_COUNT; i++)
+		if (!(skip && emu_mask >> i & 1))
+			hist_add(&prof->hist[i], cur[i]);
+	if (prof->log) {
+		fprintf(prof->log, "%u", prof->frames);
+		for (i = 0; i < PROF_COUNT; i++)
+			fprintf(prof->log, ",%llu", (unsigned long long)cur[i]);
+		fprintf(prof->log, ",%u\n", skip);
 	}
-#undef M
-#undef X
+	prof->frames++;
+	prof->skipped += skip;
+	memset(cur, 0, sizeof(prof->cur));
+	prof->start = prof->last;
+	prof->insns = sys->insn_count;
+}
 
-	window_update(&sys->window);
+static void prof_dump(sysctx_t *sys) {
+	prof_t *prof = sys->prof;
+	int i;
+	fprintf(stderr, "frames: %u, skipped: %u\n", prof->frames, prof->skipped);
+	fprintf(stderr, "%-8s %8s %8s %8s %8s %8s\n",
+			"(us)", "min", "avg", "p50", "p99", "max");
+	for (i = 0; i < PROF_COUNT; i++) {
+		hist_t *h = &prof->hist[i];
+		if (!h->count) continue;
+		fprintf(stderr, "%-8s %8llu %8llu %8llu %8llu %8llu\n", prof_names[i],
+				(unsigned long long)h->min,
+				(unsigned long long)(h->sum / h->count),
+				(unsigned long long)hist_percentile(h, 50),
+				(unsigned long long)hist_percentile(h, 99),
+				(unsigned long long)h->max);
+	}
 }
 
-typedef struct {
-	uint16_t pc;
-	uint8_t a, x, y, sp;
-	uint8_t flags, dummy;
-	uint8_t mem[0x10000];
-} cpu_state_t;
+static void prof_start(sysctx_t *sys) {
+	prof_t *prof = sys->prof;
+	if (!prof) return;
+	memset(prof->cur, 0, sizeof(prof->cur));
+	prof->start = prof->last = sys_time_us(sys);
+	prof->insns = sys->insn_count;
+}
 
-enum {
-	MASK_C = 1,
-	MASK_Z = 2,
-	MASK_I = 4,
-	MASK_D = 8,
-	MASK_B = 0x10,
-	// 0x20 is unused
-	MASK_V = 0x40,
-	MASK_N = 0x80,
-};
+static void prof_signal(int sig) {
+	(void)sig;
+	prof_dump_req = 1;
+}
 
-enum {
-	MOD_NUL, /* none */
-	MOD_IMM, /* # */
-	MOD_ACC, /* A */
-	MOD_X,   /* X */
-	MOD_Y,   /* Y */
-	MOD_Z,   /* zp */
-	MOD_ZX,  /* zp,x */
-	MOD_ZY,  /* zp,y */
-	MOD_ZI,  /* (zp) */
-	MOD_ZXI, /* (zp,x) */
-	MOD_ZIY, /* (zp),y */
-	MOD_A,   /* a */
-	MOD_AX,  /* a,x */
-	MOD_AY,  /* a,y */
-	MOD_R,   /* r */
-	MOD_LAST,
-	MOD_ZR = MOD_Z /* zp + r */
-};
+static void prof_init(sysctx_t *sys, const char *fn) {
+	prof_t *prof = calloc(1, sizeof(prof_t));
+	int i;
+	if (!prof) ERR_EXIT("malloc failed\n");
+	if (*fn) {
+		prof->log = fopen(fn, "w");
+		if (!prof->log) ERR_EXIT("can't open profiler log\n");
+		fprintf(prof->log, "n");
+		for (i = 0; i < PROF_COUNT; i++)
+			fprintf(prof->log, ",%s", prof_names[i]);
+		fprintf(prof->log, ",skip\n");
+	}
+	sys->prof = prof;
+#ifdef SIGUSR1
+	signal(SIGUSR1, prof_signal);
+#endif
+}
 
-#define X(m, cmt) MOD_##m,
-#define S(m, cmt) MOD_##m | 0x80,
-static const uint8_t op_mod[256] = {
-	X(NUL, "0x00 BRK") X(ZXI, "0x01 ORA") X(NUL, "0x02 ---") X(NUL, "0x03 ---")
-	X(Z,   "0x04 TSB") X(Z,   "0x05 ORA") X(Z,   "0x06 ASL") X(Z,   "0x07 RMB")
-	X(NUL, "0x08 PHP") X(IMM, "0x09 ORA") X(ACC, "0x0A ASL") X(NUL, "0x0B ---")
-	X(A,   "0x0C TSB") X(A,   "0x0D ORA") X(A,   "0x0E ASL") X(ZR,  "0x0F BBR")
-
-	X(R,   "0x10 BPL") X(ZIY, "0x11 ORA") X(ZI,  "0x12 ORA") X(NUL, "0x13 ---")
-	X(Z,   "0x14 TRB") X(ZX,  "0x15 ORA") X(ZX,  "0x16 ASL") X(Z,   "0x17 RMB")
-	X(NUL, "0x18 CLC") X(AY,  "0x19 ORA") X(ACC, "0x1A INC") X(NUL, "0x1B ---")
-	X(A,   "0x1C TRB") X(AX,  "0x1D ORA") X(AX,  "0x1E ASL") X(ZR,  "0x1F BBR")
-
-	X(IMM, "0x20 JSR") X(ZXI, "0x21 AND") X(NUL, "0x22 ---") X(NUL, "0x23 ---")
-	X(Z,   "0x24 BIT") X(Z,   "0x25 AND") X(Z,   "0x26 ROL") X(Z,   "0x27 RMB")
-	X(NUL, "0x28 PLP") X(IMM, "0x29 AND") X(ACC, "0x2A ROL") X(NUL, "0x2B ---")
-	X(A,   "0x2C BIT") X(A,   "0x2D AND") X(A,   "0x2E ROL") X(ZR,  "0x2F BBR")
-
-	X(R,   "0x30 BMI") X(ZIY, "0x31 AND") X(ZI,  "0x32 AND") X(NUL, "0x33 ---")
-	X(Z,   "0x34 BIT") X(ZX,  "0x35 AND") X(ZX,  "0x36 ROL") X(Z,   "0x37 RMB")
-	X(NUL, "0x38 SEC") X(AY,  "0x39 AND") X(ACC, "0x3A DEC") X(NUL, "0x3B ---")
-	X(AX,  "0x3C BIT") X(AX,  "0x3D AND") X(AX,  "0x3E ROL") X(ZR,  "0x3F BBR")
-
-	X(NUL, "0x40 RTI") X(ZXI, "0x41 EOR") X(NUL, "0x42 ---") X(NUL, "0x43 ---")
-	X(NUL, "0x44 ---") X(Z,   "0x45 EOR") X(Z,   "0x46 LSR") X(Z,   "0x47 RMB")
-	X(ACC, "0x48 PHA") X(IMM, "0x49 EOR") X(ACC, "0x4A LSR") X(NUL, "0x4B ---")
-	X(IMM, "0x4C JMP") X(A,   "0x4D EOR") X(A,   "0x4E LSR") X(ZR,  "0x4F BBR")
-
-	X(R,   "0x50 BVC") X(ZIY, "0x51 EOR") X(ZI,  "0x52 EOR") X(NUL, "0x53 ---")
-	X(NUL, "0x54 ---") X(ZX,  "0x55 EOR") X(ZX,  "0x56 LSR") X(Z,   "0x57 RMB")
-	X(NUL, "0x58 CLI") X(AY,  "0x59 EOR") X(Y,   "0x5A PHY") X(NUL, "0x5B ---")
-	X(NUL, "0x5C ---") X(AX,  "0x5D EOR") X(AX,  "0x5E LSR") X(ZR,  "0x5F BBR")
-
-	X(NUL, "0x60 RTS") X(ZXI, "0x61 ADC") X(NUL, "0x62 ---") X(NUL, "0x63 ---")
-	S(Z,   "0x64 STZ") X(Z,   "0x65 ADC") X(Z,   "0x66 ROR") X(Z,   "0x67 RMB")
-	X(ACC, "0x68 PLA") X(IMM, "0x69 ADC") X(ACC, "0x6A ROR") X(NUL, "0x6B ---")
-	X(A,   "0x6C JMP") X(A,   "0x6D ADC") X(A,   "0x6E ROR") X(ZR,  "0x6F BBR")
-
-	X(R,   "0x70 BVS") X(ZIY, "0x71 ADC") X(ZI,  "0x72 ADC") X(NUL, "0x73 ---")
-	S(ZX,  "0x74 STZ") X(ZX,  "0x75 ADC") X(ZX,  "0x76 ROR") X(Z,   "0x77 RMB")
-	X(NUL, "0x78 SEI") X(AY,  "0x79 ADC") X(Y,   "0x7A PLY") X(NUL, "0x7B ---")
-	X(AX,  "0x7C JMP") X(AX,  "0x7D ADC") X(AX,  "0x7E ROR") X(ZR,  "0x7F BBR")
-
-	X(R,   "0x80 BRA") S(ZXI, "0x81 STA") X(NUL, "0x82 ---") X(NUL, "0x83 ---")
-	S(Z,   "0x84 STY") S(Z,   "0x85 STA") S(Z,   "0x86 STX") X(Z,   "0x87 SMB")
-	X(Y,   "0x88 DEY") X(IMM, "0x89 BIT") X(NUL, "0x8A TXA") X(NUL, "0x8B ---")
-	S(A,   "0x8C STY") S(A,   "0x8D STA") S(A,   "0x8E STX") X(ZR,  "0x8F BBS")
-
-	X(R,   "0x90 BCC") S(ZIY, "0x91 STA") S(ZI,  "0x92 STA") X(NUL, "0x93 ---")
-	S(ZX,  "0x94 STY") S(ZX,  "0x95 STA") S(ZY,  "0x96 STX") X(Z,   "0x97 SMB")
-	X(NUL, "0x98 TYA") S(AY,  "0x99 STA") X(NUL, "0x9A TXS") X(NUL, "0x9B ---")
-	S(A,   "0x9C STZ") S(AX,  "0x9D STA") S(AX,  "0x9E STZ") X(ZR,  "0x9F BBS")
-
-	X(IMM, "0xA0 LDY") X(ZXI, "0xA1 LDA") X(IMM, "0xA2 LDX") X(NUL, "0xA3 ---")
-	X(Z,   "0xA4 LDY") X(Z,   "0xA5 LDA") X(Z,   "0xA6 LDX") X(Z,   "0xA7 SMB")
-	X(NUL, "0xA8 TAY") X(IMM, "0xA9 LDA") X(NUL, "0xAA TAX") X(NUL, "0xAB ---")
-	X(A,   "0xAC LDY") X(A,   "0xAD LDA") X(A,   "0xAE LDX") X(ZR,  "0xAF BBS")
-
-	X(R,   "0xB0 BCS") X(ZIY, "0xB1 LDA") X(ZI,  "0xB2 LDA") X(NUL, "0xB3 ---")
-	X(ZX,  "0xB4 LDY") X(ZX,  "0xB5 LDA") X(ZY,  "0xB6 LDX") X(Z,   "0xB7 SMB")
-	X(NUL, "0xB8 CLV") X(AY,  "0xB9 LDA") X(NUL, "0xBA TSX") X(NUL, "0xBB ---")
-	X(AX,  "0xBC LDY") X(AX,  "0xBD LDA") X(AY,  "0xBE LDX") X(ZR,  "0xBF BBS")
-
-	X(IMM, "0xC0 CPY") X(ZXI, "0xC1 CMP") X(NUL, "0xC2 ---") X(NUL, "0xC3 ---")
-	X(Z,   "0xC4 CPY") X(Z,   "0xC5 CMP") X(Z,   "0xC6 DEC") X(Z,   "0xC7 SMB")
-	X(Y,   "0xC8 INY") X(IMM, "0xC9 CMP") X(X,   "0xCA DEX") X(NUL, "0xCB WAI")
-	X(A,   "0xCC CPY") X(A,   "0xCD CMP") X(A,   "0xCE DEC") X(ZR,  "0xCF BBS")
-
-	X(R,   "0xD0 BNE") X(ZIY, "0xD1 CMP") X(ZI,  "0xD2 CMP") X(NUL, "0xD3 ---")
-	X(NUL, "0xD4 ---") X(ZX,  "0xD5 CMP") X(ZX,  "0xD6 DEC") X(Z,   "0xD7 SMB")
-	X(NUL, "0xD8 CLD") X(AY,  "0xD9 CMP") X(X,   "0xDA PHX") X(NUL, "0xDB STP")
-	X(NUL, "0xDC ---") X(AX,  "0xDD CMP") X(AX,  "0xDE DEC") X(ZR,  "0xDF BBS")
-
-	X(IMM, "0xE0 CPX") X(ZXI, "0xE1 SBC") X(NUL, "0xE2 ---") X(NUL, "0xE3 ---")
-	X(Z,   "0xE4 CPX") X(Z,   "0xE5 SBC") X(Z,   "0xE6 INC") X(Z,   "0xE7 SMB")
-	X(X,   "0xE8 INX") X(IMM, "0xE9 SBC") X(NUL, "0xEA NOP") X(NUL, "0xEB ---")
-	X(A,   "0xEC CPX") X(A,   "0xED SBC") X(A,   "0xEE INC") X(ZR,  "0xEF BBS")
-
-	X(R,   "0xF0 BEQ") X(ZIY, "0xF1 SBC") X(ZI,  "0xF2 SBC") X(NUL, "0xF3 ---")
-	X(NUL, "0xF4 ---") X(ZX,  "0xF5 SBC") X(ZX,  "0xF6 INC") X(Z,   "0xF7 SMB")
-	X(NUL, "0xF8 SED") X(AY,  "0xF9 SBC") X(X,   "0xFA PLX") X(NUL, "0xFB ---")
-	X(NUL, "0xFC ---") X(AX,  "0xFD SBC") X(AX,  "0xFE INC") X(ZR,  "0xFF BBS")
-#undef X
+/* Chrome trace-event timeline, the events are collected in one buffer */
+/* while the other is written to the file by a background thread. */
+
+#define TIMELINE_BUF (1 << 20)
+
+enum { TL_FRAME = 1, TL_CPU };
+
+struct timeline {
+	FILE *f;
+	char *buf[2], *pending;
+	unsigned cur, pos, pending_size, quit;
+	uint64_t start;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
 };
 
-#define UNPACK_FLAGS \
-	zflag = ~t & 2; \
-	nflag = t; vflag = t << 1; \
-	cflag = (t & 1) << 8;
+static void* timeline_thread(void *arg) {
+	timeline_t *tl = arg;
+	pthread_mutex_lock(&tl->lock);
+	for (;;) {
+		char *buf; unsigned n;
+		while (!tl->pending && !tl->quit)
+			pthread_cond_wait(&tl->cond, &tl->lock);
+		if (!tl->pending) break;
+		buf = tl->pending; n = tl->pending_size;
+		pthread_mutex_unlock(&tl->lock);
+		fwrite(buf, 1, n, tl->f);
+		pthread_mutex_lock(&tl->lock);
+		tl->pending = NULL;
+		pthread_cond_broadcast(&tl->cond);
+	}
+	pthread_mutex_unlock(&tl->lock);
+	return NULL;
+}
 
-#define PACK_FLAGS \
-	t = s->flags & ~0xc3; \
-	t |= cflag >> 8; \
-	t |= !zflag << 1; \
-	t |= vflag >> 1 & 0x40; \
-	t |= nflag & 0x80;
+static void timeline_flush(timeline_t *tl) {
+	pthread_mutex_lock(&tl->lock);
+	while (tl->pending) pthread_cond_wait(&tl->cond, &tl->lock);
+	tl->pending = tl->buf[tl->cur];
+	tl->pending_size = tl->pos;
+	pthread_cond_broadcast(&tl->cond);
+	pthread_mutex_unlock(&tl->lock);
+	tl->cur ^= 1; tl->pos = 0;
+}
 
-#if CPU_TRACE
-#include <stdarg.h>
-static void trace_printf(sysctx_t *sys, const char *fmt, ...) {
-	va_list va; int n;
-	char *buf = sys->log_buf;
-	unsigned pos = sys->log_pos, size;
-	if (!sys->log_buf) return;
-	va_start(va, fmt);
-	n = vsnprintf(buf + pos, 256, fmt, va);
-	va_end(va);
-	size = sys->log_size;
-	pos += n;
-	if (pos >= size) {
-		pos -= size;
-		sys->log_overflow = 1;
-		memcpy(buf, buf + size, pos);
+/* fmt is for the args object, can be empty */
+static void timeline_event(sysctx_t *sys, int ph, int tid, const char *name,
+		uint64_t ts, uint64_t dur, const char *fmt, ...) {
+	timeline_t *tl = sys->timeline;
+	char *buf, *p; va_list va;
+	if (tl->pos > TIMELINE_BUF - 1024) timeline_flush(tl);
+	p = buf = tl->buf[tl->cur];
+	p += tl->pos;
+	p += sprintf(p, "{\"ph\":\"%c\",\"pid\":1,\"tid\":%u,\"ts\":%llu",
+			ph, tid, (unsigned long long)(ts - tl->start));
+	if (*name) p += sprintf(p, ",\"name\":\"%s\"", name);
+	if (ph == 'X') p += sprintf(p, ",\"dur\":%llu", (unsigned long long)dur);
+	if (ph == 'i') p += sprintf(p, ",\"s\":\"t\"");
+	if (*fmt) {
+		p += sprintf(p, ",\"args\":{");
+		va_start(va, fmt);
+		p += vsprintf(p, fmt, va);
+		va_end(va);
+		*p++ = '}';
 	}
-	sys->log_pos = pos;
+	p += sprintf(p, "},\n");
+	tl->pos = p - buf;
+}
+
+static void timeline_init(sysctx_t *sys, const char *fn) {
+	timeline_t *tl = calloc(1, sizeof(timeline_t));
+	if (!tl) ERR_EXIT("malloc failed\n");
+	tl->buf[0] = malloc(TIMELINE_BUF * 2);
+	if (!tl->buf[0]) ERR_EXIT("malloc failed\n");
+	tl->buf[1] = tl->buf[0] + TIMELINE_BUF;
+	tl->f = fopen(fn, "wb");
+	if (!tl->f) ERR_EXIT("can't open timeline file\n");
+	pthread_mutex_init(&tl->lock, NULL);
+	pthread_cond_init(&tl->cond, NULL);
+	if (pthread_create(&tl->thread, NULL, timeline_thread, tl))
+		ERR_EXIT("pthread_create failed\n");
+	sys->timeline = tl;
+	tl->start = sys_time_us(sys);
+	fputs("[\n", tl->f);
+	timeline_event(sys, 'M', TL_FRAME, "thread_name", tl->start, 0, "\"name\":\"frames\"");
+	timeline_event(sys, 'M', TL_CPU, "thread_name", tl->start, 0, "\"name\":\"cpu\"");
+}
+
+static void timeline_close(sysctx_t *sys) {
+	timeline_t *tl = sys->timeline;
+	timeline_event(sys, 'M', TL_FRAME, "process_name", tl->start, 0, "\"name\":\"toumapet\"");
+	// the last event must not end with a comma
+	tl->pos -= 2;
+	timeline_flush(tl);
+	pthread_mutex_lock(&tl->lock);
+	tl->quit = 1;
+	pthread_cond_broadcast(&tl->cond);
+	pthread_mutex_unlock(&tl->lock);
+	pthread_join(tl->thread, NULL);
+	fputs("\n]\n", tl->f);
+	fclose(tl->f);
+	free(tl->buf[0]);
+	free(tl);
+	sys->timeline = NULL;
 }
 
-#define TRACE(...) trace_printf(sys, __VA_ARGS__)
+/* Live metrics in a shared memory page for external monitoring, */
+/* the layout is fixed, the fields are updated at the end of each frame. */
+
+#define METRICS_MAGIC 0x4d505554 /* "TUPM" */
+#define METRICS_VERSION 1
+
+struct metrics {
+	uint32_t magic, version, size, pid;
+	uint32_t model, screen_h;
+	uint64_t frames, frames_emulated, frame_skips, dropped_frames;
+	uint64_t insns, pixels;
+	uint64_t flash_writes, flash_erases;
+	uint64_t present_count, present_us_last, present_us_max, present_us_total;
+	uint64_t bios_calls[0x30 >> 1]; /* indexed by id / 2 */
+};
+
+#define METRICS_SET(field, val) __atomic_store_n(&m->field, val, __ATOMIC_RELAXED)
+#define METRICS_ADD(field, val) __atomic_fetch_add(&m->field, val, __ATOMIC_RELAXED)
+
+static char metrics_name[64];
+
+static void* shm_create(const char *name, size_t size) {
+#ifndef _WIN32
+	void *p; int fd;
+	shm_unlink(name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) return NULL;
+	if (ftruncate(fd, size)) { close(fd); return NULL; }
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return NULL;
+	memset(p, 0, size);
+	return p;
 #else
-#define TRACE(...) (void)0
+	(void)name; (void)size;
+	return NULL;
 #endif
+}
 
-#define READ16(p) ((p)[0] | (p)[1] << 8)
-#define READ24(p) ((p)[0] | (p)[1] << 8 | (p)[2] << 16)
-#define WRITE16(p, a) do { unsigned __tmp = (a); \
-	(p)[0] = __tmp; (p)[1] = __tmp >> 8; \
-} while (0)
-#define WRITE24(p, a) do { unsigned __tmp = (a); \
-	(p)[0] = __tmp; (p)[1] = __tmp >> 8; (p)[2] = __tmp >> 16; \
-} while (0)
+static void shm_close(const char *name, void *p, size_t size) {
+#ifndef _WIN32
+	munmap(p, size);
+	shm_unlink(name);
+#endif
+}
 
-static unsigned get_image(sysctx_t *sys, unsigned id) {
-	unsigned rom_size = sys->rom_size;
-	unsigned res_offs = READ24(sys->rom);
-	res_offs += id * 3;
-	if (rom_size < res_offs + 3)
-		ERR_EXIT("bad resource index (%u)", id);
-	res_offs = READ24(sys->rom + res_offs);
-	if (rom_size < res_offs + 4)
-		ERR_EXIT("bad resource offset (0x%x)", res_offs);
-	return res_offs;
+static void metrics_init(sysctx_t *sys) {
+	metrics_t *m;
+#ifndef _WIN32
+	snprintf(metrics_name, sizeof(metrics_name), "/toumapet.%u", (unsigned)getpid());
+#endif
+	m = shm_create(metrics_name, sizeof(metrics_t));
+	if (!m) ERR_EXIT("can't create shared memory for metrics\n");
+	m->version = METRICS_VERSION;
+	m->size = sizeof(metrics_t);
+#ifndef _WIN32
+	m->pid = getpid();
+#endif
+	m->model = sys->model;
+	m->screen_h = sys->screen_h;
+	// readers check the magic last
+	__atomic_store_n(&m->magic, METRICS_MAGIC, __ATOMIC_RELEASE);
+	sys->metrics = m;
 }
 
-static void draw_image(sysctx_t *sys, int x, int y,
-		unsigned pos, int flip, int blend, int alpha) {
-	int w, h, x_skip = 0, y_skip = 0;
-	uint8_t *d, *src = sys->rom + pos;
-	uint32_t size = sys->rom_size - pos;
-	int x_add, y_add, w2, h2;
-	int screen_h = sys->screen_h;
+static void metrics_frame(sysctx_t *sys, int skip, int skip_on, int dropped) {
+	metrics_t *m = sys->metrics;
+	int i;
+	METRICS_ADD(frames, 1);
+	if (!skip) {
+		METRICS_ADD(frames_emulated, 1);
+		METRICS_ADD(pixels, sys->pixels_count);
+	}
+	if (skip_on) METRICS_ADD(frame_skips, 1);
+	if (dropped) METRICS_ADD(dropped_frames, 1);
+	METRICS_SET(insns, sys->insn_count);
+	METRICS_SET(flash_writes, sys->flash_writes);
+	METRICS_SET(flash_erases, sys->flash_erases);
+	for (i = 0; i < 0x30 >> 1; i++)
+		METRICS_SET(bios_calls[i], sys->bios_count[i]);
+}
 
-	if (flip > 4) ERR_EXIT("unsupported flip\n");
-	if (flip & 4) {
-		w = src[0]; h = src[1]; src += 2;
-		w2 = ((w + 7) >> 3) * h + 2;
-		if ((int)size < w2)
-			ERR_EXIT("read outside the ROM\n");
-	} else {
-		if (src[1] != 0 || src[3] != 0x80)
-			ERR_EXIT("unsupported image\n");
-		w = src[0]; h = src[2]; src += 4; size -= 4;
+static void metrics_present(sysctx_t *sys, uint64_t time) {
+	metrics_t *m = sys->metrics;
+	METRICS_ADD(present_count, 1);
+	METRICS_SET(present_us_last, time);
+	if (m->present_us_max < time) METRICS_SET(present_us_max, time);
+	METRICS_ADD(present_us_total, time);
+}
+
+// screen pixels are RGB332
+static const uint8_t curve_r[] = { 0, 8, 24, 57, 99, 123, 214, 255 };
+static const uint8_t curve_g[] = { 0, 12, 24, 48, 85, 125, 170, 255 };
+static const uint8_t curve_b[] = { 0, 66, 132, 255 };
+
+/* Latest screen and RAM in a shared memory region for external */
+/* consumers. The writer never waits: seq is odd while the frame */
+/* is being copied, readers retry if it changed during their copy. */
+
+#define SHM_SCREEN_MAGIC 0x56505554 /* "TUPV" */
+#define SHM_SCREEN_VERSION 1
+
+struct shm_screen {
+	uint32_t magic, version, size, pid;
+	uint32_t seq, model, screen_w, screen_h;
+	uint64_t frame;
+	uint8_t pal[256][4]; /* RGBA */
+	uint8_t screen[SCREEN_W * SCREEN_H_MAX];
+	uint8_t ram[0x10000];
+};
+
+static char shm_screen_name[64];
+
+static void shm_screen_init(sysctx_t *sys) {
+	shm_screen_t *m;
+	int i;
+#ifndef _WIN32
+	snprintf(shm_screen_name, sizeof(shm_screen_name), "/toumapet-screen.%u", (unsigned)getpid());
+#endif
+	m = shm_create(shm_screen_name, sizeof(shm_screen_t));
+	if (!m) ERR_EXIT("can't create shared memory for screen\n");
+	m->version = SHM_SCREEN_VERSION;
+	m->size = sizeof(shm_screen_t);
+#ifndef _WIN32
+	m->pid = getpid();
+#endif
+	m->model = sys->model;
+	m->screen_w = SCREEN_W;
+	m->screen_h = sys->screen_h;
+	for (i = 0; i < 256; i++) {
+		m->pal[i][0] = curve_r[i >> 5 & 7];
+		m->pal[i][1] = curve_g[i >> 2 & 7];
+		m->pal[i][2] = curve_b[i & 3];
+		m->pal[i][3] = 0xff;
 	}
+	__atomic_store_n(&m->magic, SHM_SCREEN_MAGIC, __ATOMIC_RELEASE);
+	sys->shm_screen = m;
+}
 
-	w2 = w; h2 = h;
-	if (x >= SCREEN_W) x = (int8_t)x, x_skip = -x;
-	if (y >= screen_h) y = (int8_t)y, y_skip = -y;
+static void shm_screen_frame(sysctx_t *sys, cpu_state_t *s) {
+	shm_screen_t *m = sys->shm_screen;
+	uint32_t seq = m->seq;
+	__atomic_store_n(&m->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	m->frame = sys->game.frame_count;
+	memcpy(m->screen, sys->screen, SCREEN_W * sys->screen_h);
+	memcpy(m->ram, s->mem, sizeof(m->ram));
+	__atomic_store_n(&m->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-	if (x > SCREEN_W || y > screen_h) return;
-	if (x + w > SCREEN_W) w = SCREEN_W - x;
-	if (y + h > screen_h) h = screen_h - y;
-	d = &sys->screen[y * SCREEN_W + x];
+/* Animated GIF capture. The screen pixels are already indices into */
+/* the RGB332 palette, the frame loop only copies the screen into a */
+/* queue and a thread crops the changed area and does the LZW. */
 
-	x_add = 1; y_add = SCREEN_W;
-	if (flip & 1) {
-		d += w2 - 1; x_add = -x_add;
-		x = w; w = w2 - x_skip;
-		x_skip = w2 - x;
+#define VIDEO_QUEUE 32
+
+typedef struct {
+	uint32_t ts; /* 1/100 s */
+	uint8_t screen[SCREEN_W * SCREEN_H_MAX];
+} video_frame_t;
+
+struct video {
+	FILE *f;
+	const char *fn;
+	unsigned h, head, tail, count, quit, dropped;
+	uint32_t end_ts, pend_ts;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint8_t have_pend, first;
+	uint8_t shown[SCREEN_W * SCREEN_H_MAX];
+	uint8_t pend[SCREEN_W * SCREEN_H_MAX];
+	/* LZW */
+	uint32_t hash_key[1 << 14];
+	uint16_t hash_code[1 << 14];
+	uint8_t block[256];
+	unsigned block_len, acc, acc_bits;
+	video_frame_t queue[VIDEO_QUEUE];
+};
+
+static void gif_bits(video_t *v, unsigned code, unsigned size) {
+	v->acc |= code << v->acc_bits;
+	v->acc_bits += size;
+	while (v->acc_bits >= 8) {
+		v->block[++v->block_len] = v->acc;
+		v->acc >>= 8; v->acc_bits -= 8;
+		if (v->block_len == 255) {
+			v->block[0] = 255;
+			fwrite(v->block, 1, 256, v->f);
+			v->block_len = 0;
+		}
 	}
-	if (flip & 2) {
-		d += (h2 - 1) * y_add; y_add = -y_add;
-		y = h; h = h2 - y_skip;
-		y_skip = h2 - y;
+}
+
+static void gif_lzw(video_t *v, const uint8_t *s, unsigned x0, unsigned y0, unsigned w, unsigned h) {
+	unsigned x, y, prefix = ~0u, next = 258, size = 9;
+	fputc(8, v->f);
+	memset(v->hash_key, 0, sizeof(v->hash_key));
+	v->block_len = 0; v->acc = 0; v->acc_bits = 0;
+	gif_bits(v, 256, size);
+	for (y = 0; y < h; y++)
+	for (x = 0; x < w; x++) {
+		unsigned c = s[(y0 + y) * SCREEN_W + x0 + x], key, i;
+		if (prefix == ~0u) { prefix = c; continue; }
+		key = (prefix << 8 | c) + 1;
+		for (i = key * 0x9e3779b1 >> 18; v->hash_key[i]; i = (i + 1) & ((1 << 14) - 1))
+			if (v->hash_key[i] == key) break;
+		if (v->hash_key[i]) { prefix = v->hash_code[i]; continue; }
+		gif_bits(v, prefix, size);
+		if (next < 4096) {
+			if (next == 1u << size) size++;
+			v->hash_key[i] = key;
+			v->hash_code[i] = next++;
+		} else {
+			gif_bits(v, 256, size);
+			memset(v->hash_key, 0, sizeof(v->hash_key));
+			next = 258; size = 9;
+		}
+		prefix = c;
 	}
-	if (w <= 0 || h <= 0) return;
-	sys->pixels_count += w * h;
+	gif_bits(v, prefix, size);
+	gif_bits(v, 257, size);
+	if (v->acc_bits) gif_bits(v, 0, 8 - v->acc_bits);
+	if (v->block_len) {
+		v->block[0] = v->block_len;
+		fwrite(v->block, 1, v->block_len + 1, v->f);
+	}
+	fputc(0, v->f);
+}
+
+// writes the pending frame, cropped to the area that differs from the shown one
+static void gif_frame(video_t *v, uint32_t delay) {
+	unsigned x, y, x0 = SCREEN_W, x1 = 0, y0 = v->h, y1 = 0, w = SCREEN_W;
+	uint8_t hdr[18];
+	if (delay > 0xffff) delay = 0xffff;
+	if (v->first) {
+		x0 = 0; y0 = 0; x1 = w - 1; y1 = v->h - 1;
+		v->first = 0;
+	} else {
+		for (y = 0; y < v->h; y++) {
+			const uint8_t *a = v->pend + y * w, *b = v->shown + y * w;
+			if (!memcmp(a, b, w)) continue;
+			if (y0 > y) y0 = y;
+			y1 = y;
+			for (x = 0; x < x0; x++) if (a[x] != b[x]) { x0 = x; break; }
+			for (x = w - 1; x > x1; x--) if (a[x] != b[x]) { x1 = x; break; }
+		}
+		// a still frame only extends the time
+		if (y0 > y1) x0 = x1 = y0 = y1 = 0;
+	}
+	// graphic control: no disposal, delay
+	hdr[0] = 0x21; hdr[1] = 0xf9; hdr[2] = 4; hdr[3] = 1 << 2;
+	hdr[4] = delay; hdr[5] = delay >> 8; hdr[6] = 0; hdr[7] = 0;
+	// image descriptor, global palette
+	hdr[8] = 0x2c;
+	hdr[9] = x0; hdr[10] = 0; hdr[11] = y0; hdr[12] = 0;
+	hdr[13] = x1 - x0 + 1; hdr[14] = 0; hdr[15] = y1 - y0 + 1; hdr[16] = 0;
+	hdr[17] = 0;
+	fwrite(hdr, 1, 18, v->f);
+	gif_lzw(v, v->pend, x0, y0, x1 - x0 + 1, y1 - y0 + 1);
+	memcpy(v->shown, v->pend, w * v->h);
+}
+
+static void* video_thread(void *arg) {
+	video_t *v = arg;
+	unsigned size = SCREEN_W * v->h;
+	for (;;) {
+		video_frame_t *fr;
+		pthread_mutex_lock(&v->lock);
+		while (!v->count && !v->quit) pthread_cond_wait(&v->cond, &v->lock);
+		if (!v->count) {
+			pthread_mutex_unlock(&v->lock);
+			break;
+		}
+		fr = &v->queue[v->tail];
+		pthread_mutex_unlock(&v->lock);
+
+		if (!v->have_pend || memcmp(fr->screen, v->pend, size)) {
+			if (v->have_pend) gif_frame(v, fr->ts - v->pend_ts);
+			memcpy(v->pend, fr->screen, size);
+			v->pend_ts = fr->ts;
+			v->have_pend = 1;
+		}
+
+		pthread_mutex_lock(&v->lock);
+		v->tail = (v->tail + 1) % VIDEO_QUEUE;
+		v->count--;
+		pthread_mutex_unlock(&v->lock);
+	}
+	if (v->have_pend) gif_frame(v, v->end_ts - v->pend_ts);
+	return NULL;
+}
+
+static void video_init(sysctx_t *sys, const char *fn) {
+	video_t *v;
+	uint8_t hdr[13 + 256 * 3 + 19];
+	unsigned i, h = sys->screen_h;
+	FILE *f = fopen(fn, "wb");
+	if (!f) ERR_EXIT("can't open video file\n");
+	v = calloc(1, sizeof(video_t));
+	if (!v) ERR_EXIT("malloc failed\n");
+	v->f = f; v->fn = fn;
+	v->h = h; v->first = 1;
+
+	memcpy(hdr, "GIF89a", 6);
+	hdr[6] = SCREEN_W; hdr[7] = 0; hdr[8] = h; hdr[9] = 0;
+	hdr[10] = 0xf7; // global palette of 256 colors
+	hdr[11] = 0; hdr[12] = 0;
+	for (i = 0; i < 256; i++) {
+		hdr[13 + i * 3] = curve_r[i >> 5 & 7];
+		hdr[14 + i * 3] = curve_g[i >> 2 & 7];
+		hdr[15 + i * 3] = curve_b[i & 3];
+	}
+	// loops forever
+	memcpy(hdr + 13 + 256 * 3, "\x21\xff\x0bNETSCAPE2.0\x03\x01\0\0\0", 19);
+	fwrite(hdr, 1, sizeof(hdr), f);
+
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->cond, NULL);
+	if (pthread_create(&v->thread, NULL, video_thread, v))
+		ERR_EXIT("pthread_create failed\n");
+	sys->video = v;
+}
+
+static void video_frame(sysctx_t *sys, unsigned fps) {
+	video_t *v = sys->video;
+	uint64_t n = sys->game.frame_count;
+	unsigned full;
+	pthread_mutex_lock(&v->lock);
+	full = v->count == VIDEO_QUEUE;
+	pthread_mutex_unlock(&v->lock);
+	v->end_ts = (n + 1) * 100 / fps;
+	// never waits for the encoder, the next frame covers the time
+	if (full) { v->dropped++; return; }
+	v->queue[v->head].ts = n * 100 / fps;
+	memcpy(v->queue[v->head].screen, sys->screen, SCREEN_W * v->h);
+	v->head = (v->head + 1) % VIDEO_QUEUE;
+	pthread_mutex_lock(&v->lock);
+	v->count++;
+	pthread_cond_signal(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+}
+
+static void video_close(sysctx_t *sys) {
+	video_t *v = sys->video;
+	sys->video = NULL;
+	pthread_mutex_lock(&v->lock);
+	v->quit = 1;
+	pthread_cond_signal(&v->cond);
+	pthread_mutex_unlock(&v->lock);
+	pthread_join(v->thread, NULL);
+	fputc(0x3b, v->f);
+	if (ferror(v->f) | fclose(v->f))
+		fprintf(stderr, "error writing video file \"%s\"\n", v->fn);
+	if (v->dropped)
+		fprintf(stderr, "video: %u frames dropped\n", v->dropped);
+	pthread_mutex_destroy(&v->lock);
+	pthread_cond_destroy(&v->cond);
+	free(v);
+}
+
+#ifndef _WIN32
+/* Frame stream to a pipe for external encoders: YUV4MPEG2 or raw */
+/* RGB24. The fd is non-blocking, queued frames are written with */
+/* one writev per frame and new frames are dropped when it's full. */
+
+#define VPIPE_QUEUE 16
+
+enum { VPIPE_Y4M, VPIPE_RGB };
+
+struct vpipe {
+	int fd, fmt, err;
+	unsigned zoom, w, h, frame_size;
+	unsigned head, count, offs, dropped;
+	uint8_t lut[256][3]; /* YUV or RGB */
+	uint8_t *buf;
+};
+
+static void vpipe_init(sysctx_t *sys, int fd, const char *fmt, unsigned zoom) {
+	vpipe_t *v = calloc(1, sizeof(vpipe_t));
+	char hdr[128];
+	unsigned i, n;
+	if (!v) ERR_EXIT("malloc failed\n");
+	if (!strcmp(fmt, "y4m")) v->fmt = VPIPE_Y4M;
+	else if (!strcmp(fmt, "rgb")) v->fmt = VPIPE_RGB;
+	else ERR_EXIT("unknown video format\n");
+	v->fd = fd;
+	v->zoom = zoom;
+	v->w = SCREEN_W * zoom;
+	v->h = sys->screen_h * zoom;
+	n = v->w * v->h;
+	v->frame_size = v->fmt == VPIPE_Y4M ? 6 + n + n / 2 : n * 3;
+	v->buf = malloc(VPIPE_QUEUE * v->frame_size);
+	if (!v->buf) ERR_EXIT("malloc failed\n");
+
+	for (i = 0; i < 256; i++) {
+		int r = curve_r[i >> 5 & 7], g = curve_g[i >> 2 & 7], b = curve_b[i & 3];
+		if (v->fmt == VPIPE_RGB) {
+			v->lut[i][0] = r; v->lut[i][1] = g; v->lut[i][2] = b;
+		} else { // BT.601 full range
+			v->lut[i][0] = (19595 * r + 38470 * g + 7471 * b + 32768) >> 16;
+			v->lut[i][1] = (-11059 * r - 21709 * g + 32768 * b + (128 << 16) + 32768) >> 16;
+			v->lut[i][2] = (32768 * r - 27439 * g - 5329 * b + (128 << 16) + 32768) >> 16;
+		}
+	}
+
+	// a consumer that has gone away mustn't kill the emulator
+	signal(SIGPIPE, SIG_IGN);
+	if (v->fmt == VPIPE_Y4M) {
+		// the frame loop runs at 30 fps
+		n = snprintf(hdr, sizeof(hdr), "YUV4MPEG2 W%u H%u F30:1 Ip A1:1 C420jpeg\n", v->w, v->h);
+		if (write(fd, hdr, n) != (int)n) ERR_EXIT("can't write to the video pipe\n");
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	sys->vpipe = v;
+}
+
+static void vpipe_flush(vpipe_t *v) {
+	struct iovec iov[VPIPE_QUEUE];
+	unsigned i, j;
+	ssize_t ret;
+	if (!v->count || v->err) return;
+	for (i = 0; i < v->count; i++) {
+		j = (v->head + i) % VPIPE_QUEUE;
+		iov[i].iov_base = v->buf + j * v->frame_size + (i ? 0 : v->offs);
+		iov[i].iov_len = v->frame_size - (i ? 0 : v->offs);
+	}
+	do ret = writev(v->fd, iov, v->count);
+	while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+		fprintf(stderr, "video pipe: %s, streaming stopped\n", strerror(errno));
+		v->err = 1;
+		return;
+	}
+	ret += v->offs;
+	while (ret >= (ssize_t)v->frame_size) {
+		ret -= v->frame_size;
+		v->head = (v->head + 1) % VPIPE_QUEUE;
+		v->count--;
+	}
+	v->offs = ret;
+}
+
+static void vpipe_frame(sysctx_t *sys) {
+	vpipe_t *v = sys->vpipe;
+	unsigned x, y, z = v->zoom, w = v->w, h = v->h;
+	const uint8_t *s;
+	uint8_t *d;
+
+	vpipe_flush(v);
+	if (v->err) return;
+	if (v->count == VPIPE_QUEUE) { v->dropped++; return; }
+	d = v->buf + (v->head + v->count) % VPIPE_QUEUE * v->frame_size;
+
+	if (v->fmt == VPIPE_RGB) {
+		for (y = 0; y < h; y++) {
+			s = sys->screen + y / z * SCREEN_W;
+			for (x = 0; x < w; x++, d += 3) {
+				const uint8_t *c = v->lut[s[x / z]];
+				d[0] = c[0]; d[1] = c[1]; d[2] = c[2];
+			}
+		}
+	} else {
+		uint8_t *u, *vv;
+		memcpy(d, "FRAME\n", 6); d += 6;
+		for (y = 0; y < h; y++) {
+			s = sys->screen + y / z * SCREEN_W;
+			for (x = 0; x < w; x++) *d++ = v->lut[s[x / z]][0];
+		}
+		// 4:2:0, the chroma is averaged over 2x2 pixels
+		u = d; vv = d + w * h / 4;
+		for (y = 0; y < h; y += 2) {
+			const uint8_t *s0 = sys->screen + y / z * SCREEN_W;
+			const uint8_t *s1 = sys->screen + (y + 1) / z * SCREEN_W;
+			for (x = 0; x < w; x += 2) {
+				const uint8_t *a = v->lut[s0[x / z]], *b = v->lut[s0[(x + 1) / z]];
+				const uint8_t *c = v->lut[s1[x / z]], *e = v->lut[s1[(x + 1) / z]];
+				*u++ = (a[1] + b[1] + c[1] + e[1] + 2) >> 2;
+				*vv++ = (a[2] + b[2] + c[2] + e[2] + 2) >> 2;
+			}
+		}
+	}
+	v->count++;
+	vpipe_flush(v);
+}
+
+static void vpipe_close(sysctx_t *sys) {
+	vpipe_t *v = sys->vpipe;
+	sys->vpipe = NULL;
+	// the queued frames are written before exit
+	fcntl(v->fd, F_SETFL, fcntl(v->fd, F_GETFL) & ~O_NONBLOCK);
+	while (v->count && !v->err) vpipe_flush(v);
+	close(v->fd);
+	if (v->dropped)
+		fprintf(stderr, "video pipe: %u frames dropped\n", v->dropped);
+	free(v->buf);
+	free(v);
+}
+#endif
+
+/* ROM coverage: executed overlay code (instruction starts, */
+/* one bit per ROM byte), overlay calls and resource usage. */
+
+typedef struct {
+	uint32_t addr, size, calls;
+} cover_call_t;
+
+typedef struct {
+	uint32_t count; uint8_t kind;
+	uint64_t pixels;
+} cover_res_t;
+
+struct coverage {
+	const char *prefix;
+	uint8_t *code;
+	cover_call_t *calls;
+	unsigned calls_size, calls_count;
+	cover_res_t *res;
+	unsigned res_count;
+};
+
+static void cover_init(sysctx_t *sys, const char *prefix) {
+	coverage_t *cov = calloc(1, sizeof(coverage_t));
+	unsigned res_tab = READ24(sys->rom), n;
+	if (!cov) ERR_EXIT("malloc failed\n");
+	cov->prefix = prefix;
+	// the resource table ends with 0xffffff
+	for (n = 0; res_tab + n * 3 + 3 <= sys->rom_size; n++)
+		if (READ24(sys->rom + res_tab + n * 3) == 0xffffff) break;
+	cov->res_count = n;
+	cov->calls_size = 256;
+	cov->code = calloc(1, (sys->rom_size + 7) >> 3);
+	cov->calls = calloc(cov->calls_size, sizeof(cover_call_t));
+	cov->res = calloc(n + 1, sizeof(cover_res_t));
+	if (!cov->code || !cov->calls || !cov->res)
+		ERR_EXIT("malloc failed\n");
+	sys->cover = cov;
+}
+
+static cover_call_t* cover_find(coverage_t *cov, unsigned addr) {
+	cover_call_t *p;
+	unsigned mask = cov->calls_size - 1;
+	unsigned i = (addr * 0x9e3779b1u) >> 16 & mask;
+	// open addressing, address 0 is never called
+	while ((p = &cov->calls[i])->addr && p->addr != addr) i = (i + 1) & mask;
+	return p;
+}
+
+static void cover_call(sysctx_t *sys, unsigned addr, unsigned size) {
+	coverage_t *cov = sys->cover;
+	cover_call_t *p = cover_find(cov, addr);
+	if (!p->addr) {
+		if (++cov->calls_count * 2 > cov->calls_size) {
+			cover_call_t *old = cov->calls;
+			unsigned i, n = cov->calls_size;
+			cov->calls = calloc(n * 2, sizeof(cover_call_t));
+			if (!cov->calls) ERR_EXIT("malloc failed\n");
+			cov->calls_size = n * 2;
+			for (i = 0; i < n; i++)
+				if (old[i].addr) *cover_find(cov, old[i].addr) = old[i];
+			free(old);
+			p = cover_find(cov, addr);
+		}
+		p->addr = addr;
+	}
+	if (p->size < size) p->size = size;
+	p->calls++;
+}
+
+static void cover_res(sysctx_t *sys, unsigned id, int kind, unsigned pixels) {
+	coverage_t *cov = sys->cover;
+	cover_res_t *r;
+	if (id >= cov->res_count) return;
+	r = &cov->res[id];
+	r->count++;
+	r->kind = kind;
+	r->pixels += pixels;
+}
+
+static int cover_call_cmp(const void *a, const void *b) {
+	const cover_call_t *x = a, *y = b;
+	if (x->calls != y->calls) return x->calls < y->calls ? 1 : -1;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+static coverage_t *cover_sort_ctx;
+
+static int cover_res_cmp(const void *a, const void *b) {
+	const cover_res_t *res = cover_sort_ctx->res;
+	const cover_res_t *x = &res[*(const unsigned*)a], *y = &res[*(const unsigned*)b];
+	if (x->pixels != y->pixels) return x->pixels < y->pixels ? 1 : -1;
+	if (x->count != y->count) return x->count < y->count ? 1 : -1;
+	return *(const unsigned*)a < *(const unsigned*)b ? -1 : 1;
+}
+
+static unsigned cover_bits(const uint8_t *p, unsigned start, unsigned end) {
+	unsigned n = 0;
+	for (; start < end; start++) n += p[start >> 3] >> (start & 7) & 1;
+	return n;
+}
+
+static void cover_write(sysctx_t *sys, coverage_t *cov) {
+	const char *prefix = cov->prefix;
+	char *name = malloc(strlen(prefix) + 8);
+	unsigned i, j, n, nres = cov->res_count, used = 0, total = 0;
+	unsigned *idx = malloc((nres + 1) * sizeof(unsigned));
+	FILE *f;
+	if (!name || !idx) ERR_EXIT("malloc failed\n");
+
+	sprintf(name, "%s.cov", prefix);
+	f = fopen(name, "wb");
+	if (!f) ERR_EXIT("can't write coverage\n");
+	fwrite(cov->code, 1, (sys->rom_size + 7) >> 3, f);
+	fclose(f);
+
+	sprintf(name, "%s.res", prefix);
+	f = fopen(name, "wb");
+	if (!f) ERR_EXIT("can't write coverage\n");
+	for (i = 0; i < nres; i += 8) {
+		int a = 0;
+		for (j = 0; j < 8 && i + j < nres; j++)
+			a |= (cov->res[i + j].count != 0) << j;
+		fputc(a, f);
+	}
+	fclose(f);
+
+	sprintf(name, "%s.txt", prefix);
+	f = fopen(name, "w");
+	if (!f) ERR_EXIT("can't write coverage\n");
+	for (i = n = 0; i < cov->calls_size; i++)
+		if (cov->calls[i].addr) cov->calls[n++] = cov->calls[i];
+	cov->calls_count = n;
+	qsort(cov->calls, n, sizeof(cover_call_t), cover_call_cmp);
+	for (i = 0; i < n; i++) {
+		cover_call_t *p = &cov->calls[i];
+		total += p->size;
+		used += cover_bits(cov->code, p->addr, p->addr + p->size);
+	}
+	fprintf(f, "# overlays: %u, size: %u, executed: %u\n", n, total, used);
+	fprintf(f, "# %-8s %6s %10s %6s\n", "addr", "size", "calls", "exec");
+	for (i = 0; i < n; i++) {
+		cover_call_t *p = &cov->calls[i];
+		fprintf(f, "0x%06x %6u %10u %6u\n", p->addr, p->size, p->calls,
+				cover_bits(cov->code, p->addr, p->addr + p->size));
+	}
+
+	for (i = n = 0; i < nres; i++)
+		if (cov->res[i].count) idx[n++] = i;
+	cover_sort_ctx = cov;
+	qsort(idx, n, sizeof(unsigned), cover_res_cmp);
+	fprintf(f, "\n# resources: %u, used: %u\n", nres, n);
+	fprintf(f, "# %-6s %8s %4s %10s %12s\n", "id", "addr", "kind", "count", "pixels");
+	for (i = 0; i < n; i++) {
+		cover_res_t *r = &cov->res[idx[i]];
+		fprintf(f, "%-8u 0x%06x %4c %10u %12llu\n", idx[i],
+				READ24(sys->rom + READ24(sys->rom) + idx[i] * 3),
+				r->kind, r->count, (unsigned long long)r->pixels);
+	}
+	fclose(f);
+	free(idx);
+	free(name);
+}
+
+static void sys_close(sysctx_t *sys) {
+	if (!sys->headless) window_close(&sys->window);
+	else if (sys->window.imagedata) {
+		free(sys->window.imagedata);
+		sys->window.imagedata = NULL;
+	}
+	if (sys->cover) {
+		coverage_t *cov = sys->cover;
+		sys->cover = NULL;
+		cover_write(sys, cov);
+		free(cov->code);
+		free(cov->calls);
+		free(cov->res);
+		free(cov);
+	}
+	if (sys->metrics) {
+		shm_close(metrics_name, sys->metrics, sizeof(metrics_t));
+		sys->metrics = NULL;
+	}
+	if (sys->video) video_close(sys);
+	if (sys->replay) replay_close(sys);
+#ifndef _WIN32
+	if (sys->vpipe) vpipe_close(sys);
+#endif
+	if (sys->shm_screen) {
+		shm_close(shm_screen_name, sys->shm_screen, sizeof(shm_screen_t));
+		sys->shm_screen = NULL;
+	}
+	if (sys->timeline) timeline_close(sys);
+	if (sys->prof) {
+		prof_t *prof = sys->prof;
+		prof_dump(sys);
+		if (prof->log) fclose(prof->log);
+		free(prof);
+		sys->prof = NULL;
+	}
+	if (sys->log_fn) {
+		char *buf = sys->log_buf;
+		unsigned pos = sys->log_pos;
+		unsigned size = sys->log_size;
+		unsigned pos2 = pos, n = 0;
+		FILE *f;
+		if (sys->log_overflow) {
+			do {
+				if (buf[pos2++] == '\n') break;
+				if (pos2 == size) pos2 = 0;
+			} while (pos2 != pos);
+			if (pos2 < pos) n = pos - pos2, pos = 0;
+			else n = size - pos2;
+		}
+		f = fopen(sys->log_fn, "wb");
+		if (f) {
+			fwrite(buf + pos2, 1, n, f);
+			fwrite(buf, 1, pos, f);
+			fclose(f);
+		}
+	}
+}
+
+// red is the byte position of the red channel in the window pixels
+static void make_pal(uint32_t *pal, unsigned red) {
+	int i, as, rs, gs, bs;
+	rs = red << 3;
+	as = rs & 16 ? -8 : 8;
+	gs = rs + as; bs = gs + as;
+	as = (rs - as) & 24;
+
+	for (i = 0; i < 256; i++) {
+		unsigned r, g, b;
+		r = curve_r[i >> 5 & 7];
+		g = curve_g[i >> 2 & 7];
+		b = curve_b[i & 3];
+		pal[i] = r << rs | g << gs | b << bs | 0xff << as;
+	}
+}
+
+static void sys_init(sysctx_t *sys) {
+	int w = SCREEN_W * sys->zoom;
+	int h = sys->screen_h * sys->zoom;
+	if (sys->headless) {
+		// the conversion is still done to keep the timings realistic
+		sys->window.imagedata = calloc(w * h, 4);
+		if (!sys->window.imagedata) ERR_EXIT("malloc failed\n");
+		sys->window.w = w;
+		sys->window.h = h;
+		sys->window.stride = w * 4;
+		sys->window.red = 2;
+	} else {
+		const char *err = window_init(&sys->window, "ToumaPet", w, h);
+		if (err) ERR_EXIT("%s\n", err);
+	}
+
+#if !USE_SDL && defined(_WIN32)
+	{
+		LARGE_INTEGER q;
+		QueryPerformanceFrequency(&q);
+		sys->time_mul = 1000.0 / q.QuadPart;
+	}
+#endif
+
+	make_pal(sys->pal, sys->window.red);
+}
+
+static void screen_conv(const uint32_t *pal, const uint8_t *s,
+		unsigned h, uint32_t *d, unsigned st, unsigned zoom) {
+	uint32_t c;
+	unsigned j, x, y, w = SCREEN_W;
+
+#define X d[j++] = c
+#define M(m, X) case m: \
+	for (y = 0; y < h; y++, d += st * m) { \
+		for (j = x = 0; x < w; x++) { \
+			c = pal[*s++]; X; \
+		} \
+		if (m > 1) { \
+	    memcpy(d + st, d, st * 4); \
+			if (m > 2) memcpy(d + st * 2, d, st * (m < 4 ? m - 2 : 2) * 4); \
+			if (m > 4) memcpy(d + st * 4, d, st * (m - 4) * 4); \
+		} \
+	} break;
+
+	switch (zoom) {
+		M(1, X) M(2, X;X) M(3, X;X;X)
+		M(4, X;X;X;X) M(5, X;X;X;X;X) M(6, X;X;X;X;X;X)
+		M(7, X;X;X;X;X;X;X) M(8, X;X;X;X;X;X;X;X)
+	}
+#undef M
+#undef X
+}
+
+static void sys_update(sysctx_t *sys) {
+	uint64_t time = 0;
+
+	screen_conv(sys->pal, sys->screen, sys->screen_h,
+			sys->window.imagedata, sys->window.stride >> 2, sys->zoom);
+
+	prof_mark(sys, PROF_UPDATE);
+	if (sys->timeline || sys->metrics) time = sys_time_us(sys);
+	PROBE0(present_begin);
+	if (!sys->headless) window_update(&sys->window);
+	PROBE0(present_end);
+	if (sys->timeline || sys->metrics) {
+		uint64_t dur = sys_time_us(sys) - time;
+		if (sys->timeline)
+			timeline_event(sys, 'X', TL_FRAME, "present", time, dur, "");
+		if (sys->metrics) metrics_present(sys, dur);
+	}
+	prof_mark(sys, PROF_PRESENT);
+}
+
+enum {
+	MASK_C = 1,
+	MASK_Z = 2,
+	MASK_I = 4,
+	MASK_D = 8,
+	MASK_B = 0x10,
+	// 0x20 is unused
+	MASK_V = 0x40,
+	MASK_N = 0x80,
+};
+
+#include "op_mod.h"
+
+#define X(m, cmt) MOD_##m,
+#define S(m, cmt) MOD_##m | 0x80,
+static const uint8_t op_mod[256] = { OP_TABLE(X, S) };
+#undef X
+#undef S
+
+#define UNPACK_FLAGS \
+	zflag = ~t & 2; \
+	nflag = t; vflag = t << 1; \
+	cflag = (t & 1) << 8;
+
+#define PACK_FLAGS \
+	t = s->flags & ~0xc3; \
+	t |= cflag >> 8; \
+	t |= !zflag << 1; \
+	t |= vflag >> 1 & 0x40; \
+	t |= nflag & 0x80;
+
+static void trace_printf(sysctx_t *sys, const char *fmt, ...) {
+	va_list va; int n;
+	char *buf = sys->log_buf;
+	unsigned pos = sys->log_pos, size;
+	if (!sys->log_buf) return;
+	va_start(va, fmt);
+	n = vsnprintf(buf + pos, 256, fmt, va);
+	va_end(va);
+	size = sys->log_size;
+	pos += n;
+	if (pos >= size) {
+		pos -= size;
+		sys->log_overflow = 1;
+		memcpy(buf, buf + size, pos);
+	}
+	sys->log_pos = pos;
+}
+
+#define TRACE(...) (sys->log_buf ? trace_printf(sys, __VA_ARGS__) : (void)0)
+
+static unsigned get_image(sysctx_t *sys, unsigned id) {
+	unsigned rom_size = sys->rom_size;
+	unsigned res_offs = READ24(sys->rom);
+	res_offs += id * 3;
+	if (rom_size < res_offs + 3)
+		ERR_EXIT("bad resource index (%u)", id);
+	res_offs = READ24(sys->rom + res_offs);
+	if (rom_size < res_offs + 4)
+		ERR_EXIT("bad resource offset (0x%x)", res_offs);
+	return res_offs;
+}
+
+static void draw_image(sysctx_t *sys, int x, int y,
+		unsigned pos, int flip, int blend, int alpha) {
+	int w, h, x_skip = 0, y_skip = 0;
+	uint8_t *d, *src = sys->rom + pos;
+	uint32_t size = sys->rom_size - pos;
+	int x_add, y_add, w2, h2;
+	int screen_h = sys->screen_h;
+
+	if (flip > 4) ERR_EXIT("unsupported flip\n");
+	if (flip & 4) {
+		w = src[0]; h = src[1]; src += 2;
+		w2 = ((w + 7) >> 3) * h + 2;
+		if ((int)size < w2)
+			ERR_EXIT("read outside the ROM\n");
+	} else {
+		if (src[1] != 0 || src[3] != 0x80)
+			ERR_EXIT("unsupported image\n");
+		w = src[0]; h = src[2]; src += 4; size -= 4;
+	}
+
+	w2 = w; h2 = h;
+	if (x >= SCREEN_W) x = (int8_t)x, x_skip = -x;
+	if (y >= screen_h) y = (int8_t)y, y_skip = -y;
+
+	if (x > SCREEN_W || y > screen_h) return;
+	if (x + w > SCREEN_W) w = SCREEN_W - x;
+	if (y + h > screen_h) h = screen_h - y;
+	d = &sys->screen[y * SCREEN_W + x];
+
+	x_add = 1; y_add = SCREEN_W;
+	if (flip & 1) {
+		d += w2 - 1; x_add = -x_add;
+		x = w; w = w2 - x_skip;
+		x_skip = w2 - x;
+	}
+	if (flip & 2) {
+		d += (h2 - 1) * y_add; y_add = -y_add;
+		y = h; h = h2 - y_skip;
+		y_skip = h2 - y;
+	}
+	if (w <= 0 || h <= 0) return;
+	sys->pixels_count += w * h;
 	if (flip & 4) {
 		int len = (w + 7) >> 3;
 		do {
@@ -755,13 +1738,7 @@ enum {
 	FLASH_CMD2
 };
 
-#if FLASH_TRACE
-#undef FLASH_TRACE
-#define FLASH_TRACE(...) printf(__VA_ARGS__)
-#else
-#undef FLASH_TRACE
-#define FLASH_TRACE(...) (void)0
-#endif
+#define FLASH_TRACE(...) (sys->flash_trace ? (void)printf(__VA_ARGS__) : (void)0)
 
 static void flash_emu(sysctx_t *sys, cpu_state_t *s) {
 	unsigned data = s->mem[0x02];
@@ -789,6 +1766,10 @@ static void flash_emu(sysctx_t *sys, cpu_state_t *s) {
 	if (f->state == FLASH_CMD) {
 		f->cmd = f->args[0];
 		FLASH_TRACE("flash_cmd 0x%02x\n", f->cmd);
+		PROBE1(flash_cmd, f->cmd);
+		if (sys->timeline)
+			timeline_event(sys, 'i', TL_CPU, "flash_cmd", sys_time_us(sys), 0,
+					"\"cmd\":\"0x%02x\"", f->cmd);
 		switch (f->cmd) {
 		case 0x50: /* Volatile SR Write Enable */
 			f->state = FLASH_OFF;
@@ -817,6 +1798,11 @@ static void flash_emu(sysctx_t *sys, cpu_state_t *s) {
 		case 0x20: /* Sector Erase */
 			addr = READ24(f->args);
 			FLASH_TRACE("Sector Erase 0x%06x\n", addr);
+			PROBE1(flash_erase, addr);
+			sys->flash_erases++;
+			if (sys->timeline)
+				timeline_event(sys, 'i', TL_CPU, "flash_erase", sys_time_us(sys), 0,
+						"\"addr\":\"0x%06x\"", addr);
 			if (addr & 0xfff)
 				ERR_EXIT("unaligned sector address 0x%06x\n", addr);
 			if (addr < sys->save_offs || addr >= sys->rom_size)
@@ -830,6 +1816,10 @@ static void flash_emu(sysctx_t *sys, cpu_state_t *s) {
 			if (pos == ~0u) {
 				f->addr = addr = READ24(f->args);
 				FLASH_TRACE("Page Program 0x%06x\n", addr);
+				PROBE1(flash_program, addr);
+				if (sys->timeline)
+					timeline_event(sys, 'i', TL_CPU, "flash_program", sys_time_us(sys), 0,
+							"\"addr\":\"0x%06x\"", addr);
 				if (addr < sys->save_offs || addr >= sys->rom_size)
 					ERR_EXIT("unexpected program address 0x%06x\n", addr);
 				if (!(f->flags & 2)) { f->state = FLASH_OFF; break; }
@@ -840,6 +1830,8 @@ static void flash_emu(sysctx_t *sys, cpu_state_t *s) {
 				addr = (addr & ~0xff) | ((addr + pos) & 0xff);
 				old = sys->rom[addr] ^ sys->rom_key;
 				sys->rom[addr] = (old & f->args[0]) ^ sys->rom_key;
+				PROBE2(flash_write, addr, f->args[0]);
+				sys->flash_writes++;
 				f->pos = ++pos;
 				if (pos < 256) f->narg = 1 * 16;
 				else FLASH_TRACE("flash page overflow\n");
@@ -854,16 +1846,44 @@ static void flash_emu(sysctx_t *sys, cpu_state_t *s) {
 
 static void game_event(sysctx_t *sys);
 
-void run_emu(sysctx_t *sys, cpu_state_t *s) {
+/* The interpreter is compiled several times with different instrumentation, */
+/* the mode is a constant, so the unused parts are removed by the compiler. */
+enum {
+	EMU_COUNT = 1, /* counts instructions */
+	EMU_TRACE = 2, /* writes the CPU trace to the log */
+	EMU_CHECK = 4, /* stops at the instruction limit */
+	EMU_COVER = 8, /* collects the ROM coverage */
+	EMU_RAW = 16, /* plain 65C02 with flat memory, stops at a jump to itself */
+};
+
+static void cover_bios(sysctx_t *sys, cpu_state_t *s, unsigned pixels) {
+	pixels = sys->pixels_count - pixels;
+	switch (s->x) {
+	case 0x08: case 0x0a: case 0x0e:
+		cover_res(sys, READ16(s->mem + 0x102), 'i', pixels);
+		break;
+	case 0x14: case 0x16: case 0x18: case 0x1a: case 0x2c:
+		cover_res(sys, READ16(sys->rom + READ24(s->mem + 0x80) + 1), 's', 0);
+		break;
+	case 0x1c:
+		cover_res(sys, READ16(s->mem + 0x80), 'm', 0);
+		break;
+	}
+}
+
+#undef TRACE
+#define TRACE(...) (mode & EMU_TRACE ? trace_printf(sys, __VA_ARGS__) : (void)0)
+
+static inline __attribute__((always_inline))
+void run_emu_tmpl(sysctx_t *sys, cpu_state_t *s, const unsigned mode) {
 	unsigned pc = s->pc, t = s->flags;
 	uint8_t zflag; int8_t nflag, vflag; uint16_t cflag;
 	UNPACK_FLAGS
 	unsigned depth = sys->frame_depth, frame_size = 0;
 	frame_t *frames = sys->frame_stack;
-	unsigned input_timer = 0;
-#if TICK_LIMIT
-	unsigned tickcount = 0;
-#endif
+	unsigned input_timer = 0, pc0 = 0;
+	uint64_t tickcount = 0;
+	uint8_t *cover_code = mode & EMU_COVER ? sys->cover->code : NULL;
 
 	if (depth)
 		frame_size = frames[depth - 1].size;
@@ -871,29 +1891,33 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 #define NEXT s->mem[pc++ & 0xffff]
 
 	for (;;) {
-#if CPU_TRACE
-		unsigned pc2;
-#endif
 		unsigned m, op; uint8_t dummy;
 		int o = -1; uint8_t *p = NULL;
 
-#if TICK_LIMIT
-		if (++tickcount > TICK_LIMIT)
-			ERR_EXIT("instruction limit reached\n");
-#endif
+		if (mode & (EMU_COUNT | EMU_CHECK)) {
+			tickcount++;
+			if (mode & EMU_CHECK && tickcount > sys->tick_limit)
+				ERR_EXIT("instruction limit reached\n");
+		}
 
 		pc &= 0xffff;
-#if CPU_TRACE
-		pc2 = pc;
-		if (pc >= 0x300 && (pc - 0x300) < frame_size) {
-			pc2 = pc - 0x300 + 0x10000 + frames[depth - 1].addr;
+		if (mode & EMU_RAW) pc0 = pc;
+		if (mode & EMU_TRACE) {
+			unsigned pc2 = pc;
+			if (pc >= 0x300 && (pc - 0x300) < frame_size) {
+				pc2 = pc - 0x300 + 0x10000 + frames[depth - 1].addr;
+			}
+			TRACE("%04x: ", pc2);
 		}
-		TRACE("%04x: ", pc2);
-#endif
 #define SYS_RET 0x7000
 #define SYS_RET1 0x7001
-		if (pc >= 0x6000) {
+		if (!(mode & EMU_RAW) && pc >= 0x6000) {
 			if (pc == 0x6000) {
+				uint64_t time = 0;
+				unsigned pixels = sys->pixels_count;
+				if (mode & EMU_COUNT && (sys->prof || sys->timeline))
+					time = sys_time_us(sys);
+				PROBE1(bios_entry, s->x);
 				switch (s->x) {
 				case 0x06: bios_06(sys, s); break;
 				case 0x08: bios_08(sys, s); break;
@@ -913,6 +1937,16 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 				default:
 					ERR_EXIT("unknown syscall\n"); goto end;
 				}
+				PROBE2(bios_return, s->x, s->a);
+				if (mode & EMU_COUNT) sys->bios_count[s->x >> 1]++;
+				if (mode & EMU_COVER) cover_bios(sys, s, pixels);
+				if (mode & EMU_COUNT && (sys->prof || sys->timeline)) {
+					uint64_t dur = sys_time_us(sys) - time;
+					if (sys->prof) sys->prof->cur[PROF_BIOS] += dur;
+					if (sys->timeline)
+						timeline_event(sys, 'X', TL_CPU, bios_names[s->x >> 1],
+								time, dur, "\"x\":\"0x%02x\"", s->x);
+				}
 			} else if (pc == 0x6003) {
 				unsigned addr = READ24(s->mem + 0x80), i, n;
 				TRACE("ROM read (0x%x)\n", addr);
@@ -922,10 +1956,16 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 				for (i = 0; i < 6; i++)
 					s->mem[0x8d + i] = i < n ?
 							sys->rom[addr + i] : ~sys->rom_key;
+				if (mode & EMU_COUNT && sys->timeline)
+					timeline_event(sys, 'i', TL_CPU, "rom_read",
+							sys_time_us(sys), 0, "\"addr\":\"0x%x\"", addr);
 			} else if (pc == SYS_RET) {
 				unsigned addr;
 				if (!depth) ERR_EXIT("call stack underflow\n");
 				depth--;
+				PROBE1(rom_return, depth);
+				if (mode & EMU_COUNT && sys->timeline)
+					timeline_event(sys, 'E', TL_CPU, "", sys_time_us(sys), 0, "");
 				if (!depth) { TRACE("last call\n"); goto end; }
 				addr = frames[depth - 1].addr;
 				frame_size = frames[depth - 1].size;
@@ -948,6 +1988,19 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 				frames[depth].addr = addr;
 				frames[depth].size = frame_size;
 				depth++;
+				PROBE4(rom_call, addr, frame_size, depth, tail_call);
+				if (mode & EMU_COVER) cover_call(sys, addr, frame_size);
+
+				if (mode & EMU_COUNT && sys->timeline) {
+					uint64_t time = sys_time_us(sys);
+					char name[16];
+					snprintf(name, sizeof(name), "0x%x", addr);
+					if (tail_call)
+						timeline_event(sys, 'E', TL_CPU, "", time, 0, "");
+					timeline_event(sys, 'B', TL_CPU, name, time, 0,
+							"\"size\":%u,\"depth\":%u,\"tail\":%u",
+							frame_size, depth, tail_call);
+				}
 
 				if (!tail_call) {
 					pc = SYS_RET - 1;
@@ -965,6 +2018,10 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 			}
 			s->mem[pc = SYS_RET1] = 0x60;
 		}
+		if (mode & EMU_COVER && pc - 0x300 < frame_size) {
+			unsigned a = frames[depth - 1].addr + pc - 0x300;
+			cover_code[a >> 3] |= 1 << (a & 7);
+		}
 		op = s->mem[pc++];
 		m = op_mod[op];
 		t = m & 0x7f;
@@ -1006,7 +2063,7 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 
 		// CPU memory map
 		// ports (128) + RAM (2048)
-		if (o >= 0x880) {
+		if (!(mode & EMU_RAW) && o >= 0x880) {
 			// 0x8000: LCD cmd, 0xc000: LCD data
 			if (o >= 0x8000) p = &dummy, *p = 0;
 			// chip ROM (8192)
@@ -1015,14 +2072,15 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 			else p = s->mem + 128 + ((o - 128) & 0x7ff);
 		}
 
-		if (o >= 0 && !(m & 0x80)) {
+		if (!(mode & EMU_RAW) && o >= 0 && !(m & 0x80)) {
 			TRACE("R[0x%02x] ", o);
 			// reads memory
 			switch (o) {
 			case 0x00:
 				if (++input_timer >= 16) {
 					input_timer = 0;
-					game_event(sys);
+					// the input must be the same for both engines
+					if (!sys->frame_input) game_event(sys);
 				}
 				*p = ~sys->keys;
 				break;
@@ -1256,7 +2314,10 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 			zflag = t; nflag = t; break;
 
 		case 0x08: /* PHP */
-			PACK_FLAGS goto op_push;
+			PACK_FLAGS
+			// B and the unused bit are always pushed by a real CPU
+			if (mode & EMU_RAW) t |= 0x30;
+			goto op_push;
 		case 0x48: /* PHA */
 		case 0x5a: /* PHY */
 		case 0xda: /* PHX */
@@ -1277,11 +2338,11 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 		case 0xfa: /* PLX */
 			s->sp = o = s->sp + 1;
 			t = s->mem[0x100 + (o & 0xff)];
-#if CPU_TRACE
-			TRACE("S = %02x, ", o); o = -1;
-#else
-			*p = t; p = NULL;
-#endif
+			if (mode & EMU_TRACE) {
+				TRACE("S = %02x, ", o); o = -1;
+			} else {
+				*p = t; p = NULL;
+			}
 			break;
 
 		case 0x20: /* JSR */
@@ -1329,8 +2390,28 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 		case 0xd3: case 0xd4: case 0xdc:
 		case 0xe2: case 0xe3: case 0xeb:
 		case 0xf3: case 0xf4: case 0xfb: case 0xfc:
+		case 0xdb: /* STP */
+			if (mode & EMU_RAW && op != 0xdb) {
+				// NOPs of different length on 65C02
+				if ((op & 0xf) == 2 || op == 0x44 || (op & 0x1f) == 0x14) pc++;
+				else if ((op & 0xf) == 0xc) pc += 2;
+				break;
+			}
+			fprintf(stderr, "unexpected opcode 0x%02x\n", op);
+			goto end;
+
 		case 0x00: /* BRK */
-		case 0xdb: /* STP */
+			if (mode & EMU_RAW) {
+				o = s->sp; s->sp = o - 3;
+				pc++;
+				s->mem[0x100 + o] = pc >> 8;
+				s->mem[0x100 + ((o - 1) & 0xff)] = pc;
+				PACK_FLAGS
+				s->mem[0x100 + ((o - 2) & 0xff)] = t | 0x30;
+				s->flags = (t | MASK_I) & ~MASK_D;
+				pc = READ16(s->mem + 0xfffe);
+				break;
+			}
 			fprintf(stderr, "unexpected opcode 0x%02x\n", op);
 			goto end;
 
@@ -1344,13 +2425,14 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 			if ((unsigned)o < 0x80)
 				printf("%04x: [0x%02x] = 0x%02x\n", pc2, o, t);
 #endif
-#if CPU_TRACE
-			if (o >= 0) TRACE("[0x%02x] = 0x%02x", o, t & 0xff);
-			else if (p == &s->a) TRACE("A = 0x%02x", t & 0xff);
-			else if (p == &s->x) TRACE("X = 0x%02x", t & 0xff);
-			else if (p == &s->y) TRACE("Y = 0x%02x", t & 0xff);
-#endif
-			if (o == 0x02) flash_emu(sys, s);
+			if (mode & EMU_TRACE) {
+				if (o >= 0) TRACE("[0x%02x] = 0x%02x", o, t & 0xff);
+				else if (p == &s->a) TRACE("A = 0x%02x", t & 0xff);
+				else if (p == &s->x) TRACE("X = 0x%02x", t & 0xff);
+				else if (p == &s->y) TRACE("Y = 0x%02x", t & 0xff);
+			}
+			if (mode & EMU_RAW) /* no ports */;
+			else if (o == 0x02) flash_emu(sys, s);
 			else if (o == 0x12) {
 				sys->flash.state = t ? FLASH_OFF : FLASH_READY;
 			} else if (o == 0x00) {
@@ -1366,15 +2448,171 @@ void run_emu(sysctx_t *sys, cpu_state_t *s) {
 				}
 			}
 		}
-#if CPU_TRACE
 		TRACE("\n");
-#endif
+		if (mode & EMU_RAW && pc == pc0) break;
 	}
 end:
 	PACK_FLAGS
 	s->flags = t;
 	s->pc = pc;
 	sys->frame_depth = depth;
+	if (mode & EMU_COUNT) sys->insn_count += tickcount;
+}
+
+#undef TRACE
+#define TRACE(...) (sys->log_buf ? trace_printf(sys, __VA_ARGS__) : (void)0)
+
+#define X(name, mode) \
+static void run_emu_##name(sysctx_t *sys, cpu_state_t *s) { \
+	run_emu_tmpl(sys, s, mode); \
+}
+X(fast, 0)
+X(count, EMU_COUNT)
+X(trace, EMU_COUNT | EMU_TRACE)
+X(check, EMU_COUNT | EMU_CHECK)
+X(cover, EMU_COUNT | EMU_COVER)
+X(raw, EMU_COUNT | EMU_CHECK | EMU_RAW)
+#undef X
+
+static const struct {
+	const char *name; run_emu_t *fn;
+} emu_variants[] = {
+	{ "fast", run_emu_fast },
+	{ "count", run_emu_count },
+	{ "trace", run_emu_trace },
+	{ "check", run_emu_check },
+	{ "cover", run_emu_cover },
+	{ "raw", run_emu_raw },
+	{ NULL, NULL }
+};
+
+/* Lockstep validation: each call runs the tested engine and then */
+/* the reference engine from the same state, and compares the results. */
+
+struct lockstep {
+	run_emu_t *run, *ref;
+	const char *run_name, *ref_name;
+	uint64_t calls;
+	sysctx_t sys_before, sys_after;
+	cpu_state_t cpu_before, cpu_after;
+	uint8_t *save_before, *save_after;
+	coverage_t *cover; /* the coverage of the reference */
+};
+
+static unsigned lockstep_rom_pc(sysctx_t *sys, cpu_state_t *s, unsigned pc) {
+	unsigned depth = sys->frame_depth;
+	// the frame starts with a ROM call
+	if (pc == 0x60de || pc == 0x6052) return READ24(s->mem + 0x80);
+	if (depth && pc - 0x300 < sys->frame_stack[depth - 1].size)
+		return sys->frame_stack[depth - 1].addr + pc - 0x300;
+	return pc;
+}
+
+static int lockstep_cmp(const uint8_t *a, const uint8_t *b, unsigned n) {
+	unsigned i;
+	if (!memcmp(a, b, n)) return -1;
+	for (i = 0; a[i] == b[i]; i++);
+	return i;
+}
+
+static void lockstep_check(sysctx_t *sys, cpu_state_t *s) {
+	lockstep_t *ls = sys->lockstep;
+	sysctx_t *s1 = &ls->sys_after;
+	cpu_state_t *c1 = &ls->cpu_after;
+	uint8_t *save = sys->rom + sys->save_offs;
+	unsigned save_size = sys->rom_size - sys->save_offs;
+	int diff = 0, i;
+
+#define REPORT(...) (diff++ ? (void)0 : (void)fprintf(stderr, \
+	"lockstep: %s and %s diverge at call %llu (ROM 0x%x)\n", \
+	ls->run_name, ls->ref_name, (unsigned long long)ls->calls, \
+	lockstep_rom_pc(&ls->sys_before, &ls->cpu_before, ls->cpu_before.pc)), \
+	(void)fprintf(stderr, __VA_ARGS__))
+	if (c1->pc != s->pc || s1->frame_depth != sys->frame_depth)
+		REPORT("  pc: 0x%04x (ROM 0x%x, depth %u) / 0x%04x (ROM 0x%x, depth %u)\n",
+				c1->pc, lockstep_rom_pc(s1, c1, c1->pc), s1->frame_depth,
+				s->pc, lockstep_rom_pc(sys, s, s->pc), sys->frame_depth);
+	if (c1->a != s->a || c1->x != s->x || c1->y != s->y ||
+			c1->sp != s->sp || c1->flags != s->flags)
+		REPORT("  regs: A=%02x X=%02x Y=%02x S=%02x P=%02x / A=%02x X=%02x Y=%02x S=%02x P=%02x\n",
+				c1->a, c1->x, c1->y, c1->sp, c1->flags,
+				s->a, s->x, s->y, s->sp, s->flags);
+	if ((i = lockstep_cmp(c1->mem, s->mem, sizeof(s->mem))) >= 0)
+		REPORT("  mem[0x%04x]: 0x%02x / 0x%02x\n", i, c1->mem[i], s->mem[i]);
+	if ((i = lockstep_cmp(s1->screen, sys->screen, sizeof(sys->screen))) >= 0)
+		REPORT("  screen (%u, %u): 0x%02x / 0x%02x\n",
+				i % SCREEN_W, i / SCREEN_W, s1->screen[i], sys->screen[i]);
+	if ((i = lockstep_cmp(ls->save_after, save, save_size)) >= 0)
+		REPORT("  flash 0x%06x: 0x%02x / 0x%02x\n", sys->save_offs + i,
+				ls->save_after[i] ^ sys->rom_key, save[i] ^ sys->rom_key);
+	if (memcmp(&s1->flash, &sys->flash, sizeof(sys->flash)))
+		REPORT("  flash state differs\n");
+	if (s1->keys != sys->keys || s1->pixels_count != sys->pixels_count)
+		REPORT("  keys: 0x%x / 0x%x, pixels: %u / %u\n",
+				s1->keys, sys->keys, s1->pixels_count, sys->pixels_count);
+#undef REPORT
+	if (diff) ERR_EXIT("lockstep check failed\n");
+}
+
+static void run_emu_lockstep(sysctx_t *sys, cpu_state_t *s) {
+	lockstep_t *ls = sys->lockstep;
+	uint8_t *save = sys->rom + sys->save_offs;
+	unsigned save_size = sys->rom_size - sys->save_offs;
+
+	ls->sys_before = *sys;
+	ls->cpu_before = *s;
+	memcpy(ls->save_before, save, save_size);
+	ls->run(sys, s);
+
+	ls->sys_after = *sys;
+	ls->cpu_after = *s;
+	memcpy(ls->save_after, save, save_size);
+	*sys = ls->sys_before;
+	*s = ls->cpu_before;
+	memcpy(save, ls->save_before, save_size);
+	// the reference must not repeat the side effects
+	sys->prof = NULL; sys->timeline = NULL;
+	sys->metrics = NULL; sys->log_buf = NULL;
+	sys->cover = ls->cover;
+	ls->ref(sys, s);
+	// the outputs are written on a failure
+	sys->prof = ls->sys_after.prof; sys->timeline = ls->sys_after.timeline;
+	sys->metrics = ls->sys_after.metrics; sys->log_buf = ls->sys_after.log_buf;
+	sys->cover = ls->sys_after.cover;
+
+	lockstep_check(sys, s);
+	// keeps the counters of the tested engine
+	*sys = ls->sys_after;
+	ls->calls++;
+}
+
+static void lockstep_init(sysctx_t *sys, const char *ref_name, const char *run_name) {
+	lockstep_t *ls = calloc(1, sizeof(lockstep_t));
+	unsigned save_size = sys->rom_size - sys->save_offs;
+	int i;
+	if (!ls) ERR_EXIT("malloc failed\n");
+	for (i = 0; emu_variants[i].name; i++)
+		if (!strcmp(emu_variants[i].name, ref_name)) break;
+	if (!emu_variants[i].name) ERR_EXIT("unknown interpreter variant\n");
+	if (emu_variants[i].fn == run_emu_raw ||
+			(emu_variants[i].fn == run_emu_cover && !sys->cover))
+		ERR_EXIT("unsupported reference variant\n");
+	ls->ref = emu_variants[i].fn;
+	ls->ref_name = emu_variants[i].name;
+	if (ls->ref == run_emu_cover) {
+		coverage_t *cov = sys->cover;
+		cover_init(sys, NULL);
+		ls->cover = sys->cover;
+		sys->cover = cov;
+	}
+	ls->run = sys->run_emu;
+	ls->run_name = run_name;
+	ls->save_before = malloc(save_size);
+	ls->save_after = malloc(save_size);
+	if (!ls->save_before || !ls->save_after) ERR_EXIT("malloc failed\n");
+	sys->lockstep = ls;
+	sys->frame_input = 1;
+	sys->run_emu = run_emu_lockstep;
 }
 
 static uint8_t* loadfile(const char *fn, size_t *num, size_t nmax) {
@@ -1399,6 +2637,7 @@ static uint8_t* loadfile(const char *fn, size_t *num, size_t nmax) {
 static void game_event(sysctx_t *sys) {
 	for (;;) {
 		int ev, key, key2;
+		if (sys->headless) break;
 		ev = window_event(&sys->window, &key);
 		if (ev == EVENT_EMPTY) break;
 		switch (ev) {
@@ -1439,179 +2678,1461 @@ static void game_event(sysctx_t *sys) {
 			if (key2 >= 0) {
 				key2 = 1 << key2;
 				key = ev == EVENT_KEY_PRESS ? key2 : 0;
-				sys->keys = (sys->keys & ~key2) | key;
+				key = (sys->keys & ~key2) | key;
+				if (key != (int)sys->keys)
+					PROBE2(key_change, sys->keys, key);
+				sys->keys = key;
 			}
 			break;
 
-		case EVENT_EMPTY:
-		case EVENT_QUIT:
-			sys->keys |= 1 << 16;
+		case EVENT_EMPTY:
+		case EVENT_QUIT:
+			sys->keys |= 1 << 16;
+			return;
+		}
+	}
+}
+
+#include <time.h>
+
+static void update_time(sysctx_t *sys, cpu_state_t *s) {
+	time_t t = time(NULL);
+	struct tm *tm = localtime(&t);
+	// ToumaPet or QPet 2
+	int off = sys->model >= 550 ? 0x1df : 0x1dc;
+	s->mem[off] = tm->tm_year % 100;
+	s->mem[off + 1] = tm->tm_mon;
+	s->mem[off + 2] = tm->tm_mday - 1;
+	s->mem[off + 3] = tm->tm_hour;
+	s->mem[off + 4] = tm->tm_min;
+	s->mem[off + 5] = tm->tm_sec * 2;
+}
+
+/* The frame loop is split, so that the daemon can step the instances. */
+
+static void game_init(sysctx_t *sys, cpu_state_t *s) {
+	sys->game.frames = 0;
+	if (!sys->init_done) {
+		sys->init_done = 1;
+		s->mem[0xa3] |= 1; // to play start animation
+#if 0 // Opens at boot when the left and right buttons are pressed.
+		s->mem[0x93] |= 1; // to open test menu
+#endif
+		s->mem[0x99] = sys->rom_key;
+
+		sys->frame_depth = 0;
+		s->sp = 0x7f; // guess
+		s->pc = 0x60de;
+		WRITE24(s->mem + 0x80, READ16(sys->rom + 3));
+		WRITE16(s->mem + 0x83, READ16(sys->rom + 3 + 2));
+		sys->run_emu(sys, s);
+	}
+	sys->game.last_time = game_time_ms(sys);
+}
+
+static void game_reset(sysctx_t *sys, cpu_state_t *s) {
+	sys->keys &= 0xff;
+	sys->init_done = 0;
+	memset(s, 0, sizeof(*s));
+}
+
+static void game_frame(sysctx_t *sys, cpu_state_t *s) {
+	game_state_t *g = &sys->game;
+	unsigned fps = 30;
+	int skip = 0, skip_on = 0, dropped = 0;
+	unsigned a, cur_time;
+	uint64_t frame_time = sys->timeline ? sys_time_us(sys) : 0;
+
+	PROBE1(frame_begin, g->frame_count);
+
+	if (!(s->mem[0x93] & 1 << 4)) {
+		int i;
+		for (i = 0; i < 10; i++) {
+			a = s->mem[0x183 + i];
+			if (a) s->mem[0x183 + i] = a - 1;
+		}
+	}
+
+	a = s->mem[0xaf];
+	if (a & 0x3f) s->mem[0xaf] = a - 1;
+
+	// decrease idle timer
+	a = READ16(s->mem + 0x181);
+	//if (a) WRITE16(s->mem + 0x181, a < 30 ? 0 : a - 30);
+	if (a) WRITE16(s->mem + 0x181, a - 1);
+
+	a = game_time_ms(sys) - g->last_time;
+	if (a > 500) {
+		g->last_time += 500;
+		s->mem[0xaf] |= 1 << 7;
+	}
+
+	if (sys->keys & 1 << 19) { /* WAI */
+		sys->keys &= ~(1 << 19);
+	} else {
+		sys->pixels_count = 0;
+		sys->frame_depth = 0;
+		s->sp = 0x7f; // guess
+		s->pc = 0x60de;
+		WRITE24(s->mem + 0x80, READ16(sys->rom + 0x1b));
+		WRITE16(s->mem + 0x83, READ16(sys->rom + 0x1b + 2));
+	}
+	if (g->frame_skip) g->frame_skip--, skip = 1, g->skipped++;
+	else {
+		sys->run_emu(sys, s);
+		if (sys->frame_depth == 0) {
+			/* Mini-games run too fast, because the real CPU */
+			/* can't compute one frame in time. */
+			/* This is a heuristic to solve this. */
+			g->frame_skip = (sys->pixels_count > 20000) + (sys->pixels_count > 40000);
+			skip_on = g->frame_skip != 0;
+		}
+		if (sys->keys & 1 << 20) { // clean screen
+			sys->keys &= ~(1 << 20);
+			memset(sys->screen, 0, sizeof(sys->screen));
+		}
+	}
+	prof_mark(sys, PROF_EMU);
+
+	sys_update(sys);
+#if 0
+	sys_sleep(1000 / fps);
+#else
+	if (sys->replay)
+		sys->vclock = g->frame_count / fps * 1000 + (g->frame_count % fps + 1) * 1000 / fps;
+	else if (sys->turbo) sys->vclock = g->disp_time + (g->frames + 1) * 1000 / fps;
+	cur_time = sys_time_ms(sys);
+	if (++g->frames >= fps)
+		g->disp_time += 1000, g->frames = 0;
+	a = g->frames * 1000 / fps + g->disp_time - cur_time;
+	if ((int)a < 0) g->disp_time = cur_time, g->frames = 0, dropped = 1;
+	else if (!sys->turbo) sys_sleep(a);
+#endif
+	prof_mark(sys, PROF_SLEEP);
+
+	game_event(sys);
+	PROBE3(frame_end, g->frame_count, skip, skip ? 0 : sys->pixels_count);
+	if (sys->timeline)
+		timeline_event(sys, 'X', TL_FRAME, "frame", frame_time,
+				sys_time_us(sys) - frame_time, "\"n\":%u,\"skip\":%u,\"pixels\":%u",
+				g->frame_count, skip, skip ? 0 : sys->pixels_count);
+	if (++g->frame_count == sys->frame_limit) sys->keys |= 1 << 16;
+	if (sys->replay) replay_frame(sys);
+	if (sys->metrics) metrics_frame(sys, skip, skip_on, dropped);
+	if (sys->shm_screen) shm_screen_frame(sys, s);
+	if (sys->video) video_frame(sys, fps);
+#ifndef _WIN32
+	if (sys->vpipe) vpipe_frame(sys);
+#endif
+	if (sys->prof) {
+		prof_mark(sys, PROF_EVENT);
+		prof_frame(sys, skip);
+		if (prof_dump_req) prof_dump_req = 0, prof_dump(sys);
+	}
+}
+
+static void run_game(sysctx_t *sys, cpu_state_t *s) {
+	game_state_t *g = &sys->game;
+	uint64_t bench_time = 0, bench_insns = 0;
+reset:
+	game_init(sys, s);
+
+#ifndef START_DELAY
+// to be able to open the test menu
+#define START_DELAY 500
+#endif
+
+	sys_update(sys);
+#if START_DELAY
+	if (!sys->headless) {
+		sys_sleep(START_DELAY);
+		game_event(sys);
+	}
+#endif
+	if (sys->replay) replay_frame(sys);
+
+	g->disp_time = sys_time_ms(sys);
+	prof_start(sys);
+	if (sys->bench) {
+		bench_time = sys_time_us(sys);
+		bench_insns = sys->insn_count;
+	}
+	while (!(sys->keys & 3 << 16)) game_frame(sys, s);
+	if (!(sys->keys & 1 << 16)) {
+		game_reset(sys, s);
+		goto reset;
+	}
+	if (sys->bench) {
+		double t = (sys_time_us(sys) - bench_time) * 1e-6;
+		uint64_t insns = sys->insn_count - bench_insns;
+		printf("frames: %u (emulated %u), time: %.3f s, fps: %.1f",
+				g->frame_count, g->frame_count - g->skipped, t, g->frame_count / t);
+		if (insns) printf(", MIPS: %.2f", insns * 1e-6 / t);
+		printf("\n");
+	}
+}
+
+static void rom_xor(uint8_t *p, unsigned n, unsigned key) {
+	uint64_t a, k = key * 0x0101010101010101ull;
+	unsigned i = 0;
+	if (!key) return;
+	// the compiler vectorizes this loop
+	for (; i + 8 <= n; i += 8) {
+		memcpy(&a, p + i, 8); a ^= k; memcpy(p + i, &a, 8);
+	}
+	for (; i < n; i++) p[i] ^= key;
+}
+
+/* Runs a flat 64K image (for example, the 65C02 functional tests) */
+/* until it jumps to itself, then checks the stop address and memory. */
+
+typedef struct {
+	const char *fn;
+	unsigned load;
+	int start, success, check_addr, check_val;
+} raw_opts_t;
+
+static int run_raw(sysctx_t *sys, cpu_state_t *s, raw_opts_t *o) {
+	uint8_t *buf; size_t size;
+	uint64_t time; double t;
+	int ok = 1;
+
+	buf = loadfile(o->fn, &size, 0x10000);
+	if (!buf) ERR_EXIT("can't load raw image\n");
+	if (o->load + size > 0x10000)
+		ERR_EXIT("raw image doesn't fit\n");
+	memcpy(s->mem + o->load, buf, size);
+	free(buf);
+
+	s->pc = o->start >= 0 ? o->start : READ16(s->mem + 0xfffc);
+	s->sp = 0xff;
+	s->flags = 0x34;
+	time = sys_time_us(sys);
+	sys->run_emu(sys, s);
+	t = (sys_time_us(sys) - time) * 1e-6;
+
+	printf("stopped at 0x%04x", s->pc);
+	if (sys->keys & 1 << 19) printf(" (WAI)");
+	printf(", instructions: %llu, time: %.3f s, MIPS: %.2f\n",
+			(unsigned long long)sys->insn_count, t, sys->insn_count * 1e-6 / t);
+	printf("A = 0x%02x, X = 0x%02x, Y = 0x%02x, S = 0x%02x, P = 0x%02x\n",
+			s->a, s->x, s->y, s->sp, s->flags);
+	if (o->success >= 0 && s->pc != o->success) ok = 0;
+	if (o->check_addr >= 0) {
+		int a = s->mem[o->check_addr];
+		printf("[0x%04x] = 0x%02x\n", o->check_addr, a);
+		if (a != o->check_val) ok = 0;
+	}
+	if (o->success >= 0 || o->check_addr >= 0)
+		printf("%s\n", ok ? "PASS" : "FAIL");
+	return !ok;
+}
+
+static void check_rom(sysctx_t *sys) {
+	unsigned rom_size = sys->rom_size;
+	unsigned res_offs;
+	unsigned i, key, moffs = 0x23;
+	const char *magic = "tony";
+	if (rom_size < 0x10000)
+		ERR_EXIT("ROM is too small\n");
+	sys->rom_key = key = sys->rom[moffs] ^ magic[0];
+	for (i = 1; i < 4; i++) {
+		if ((sys->rom[moffs + i] ^ key) != (unsigned)magic[i])
+			ERR_EXIT("ROM magic doesn't match\n");
+	}
+	rom_xor(sys->rom, rom_size, key);
+	res_offs = READ24(sys->rom);
+	if (rom_size < res_offs)
+		ERR_EXIT("bad resources offset\n");
+}
+
+static void sys_model(sysctx_t *sys, size_t rom_size) {
+	// a rough way to detect a model
+	if (rom_size == 2 << 20) {
+		sys->model = 2; // QPet 2
+		sys->screen_h = 128;
+		sys->keymap[0] = 4;
+		sys->keymap[1] = 5;
+		sys->keymap[2] = 6;
+		sys->keymap[3] = 8; // no button
+		sys->keymap[4] = 8; // no button
+	} else if (rom_size == 4 << 20) {
+		sys->model = 550;
+		sys->screen_h = 128;
+		sys->keymap[0] = 4;
+		sys->keymap[1] = 5;
+		sys->keymap[2] = 6;
+		sys->keymap[3] = 3;
+		sys->keymap[4] = 2;
+	} else if (rom_size == 8 << 20) {
+		sys->model = 560;
+		sys->screen_h = 160;
+		sys->keymap[0] = 2;
+		sys->keymap[1] = 3;
+		sys->keymap[2] = 4;
+		sys->keymap[3] = 5;
+		sys->keymap[4] = 6;
+	} else ERR_EXIT("unexpected ROM size\n");
+}
+
+static void xor_save(sysctx_t *sys) {
+	rom_xor(sys->rom + sys->save_offs,
+			sys->rom_size - sys->save_offs, sys->rom_key);
+}
+
+/* Emulator state for the snapshots, the ROM itself */
+/* isn't saved, only the flash save area. */
+
+#define STATE_MAGIC 0x53505554 /* "TUPS" */
+
+static size_t state_copy(sysctx_t *sys, cpu_state_t *s, uint8_t *buf, int load) {
+	const struct { void *p; size_t n; } f[] = {
+		{ s, sizeof(*s) },
+		{ &sys->flash, sizeof(sys->flash) },
+		{ &sys->game, sizeof(sys->game) },
+		{ &sys->keys, sizeof(sys->keys) },
+		{ &sys->init_done, 1 },
+		{ &sys->frame_depth, 1 },
+		{ &sys->pixels_count, sizeof(sys->pixels_count) },
+		{ &sys->vclock, sizeof(sys->vclock) },
+		{ sys->frame_stack, sizeof(sys->frame_stack) },
+		{ sys->screen, sizeof(sys->screen) },
+		{ sys->rom + sys->save_offs, sys->rom_size - sys->save_offs } };
+	unsigned i, nf = sizeof(f) / sizeof(*f);
+	uint32_t head[3] = { STATE_MAGIC, sys->model, 0 };
+	size_t n = sizeof(head);
+	for (i = 0; i < nf; i++) n += f[i].n;
+	head[2] = n;
+	if (!buf) return n;
+	if (load && memcmp(buf, head, sizeof(head))) return 0;
+	if (!load) memcpy(buf, head, sizeof(head));
+	for (buf += sizeof(head), i = 0; i < nf; buf += f[i++].n)
+		if (load) memcpy(f[i].p, buf, f[i].n);
+		else memcpy(buf, f[i].p, f[i].n);
+	return n;
+}
+
+#define state_size(sys, s) state_copy(sys, s, NULL, 0)
+#define state_save(sys, s, buf) state_copy(sys, s, buf, 0)
+#define state_load(sys, s, buf) state_copy(sys, s, buf, 1)
+
+static uint64_t hash_mem(uint64_t h, const uint8_t *p, size_t n) {
+	size_t i;
+	for (i = 0; i + 8 <= n; i += 8) {
+		uint64_t a; memcpy(&a, p + i, 8);
+		h = (h ^ a) * 0x9e3779b97f4a7c15ull;
+		h ^= h >> 29;
+	}
+	return h;
+}
+
+#define screen_hash(sys) hash_mem(0, (sys)->screen, SCREEN_W * (sys)->screen_h)
+
+/* Predicates on the RAM and the screen, comma-separated conditions */
+/* that must all hold: addr[&mask]=value, addr[&mask]!=value, */
+/* addr[&mask]~ (differs from the start) or screen=hash. */
+
+#define PRED_MAX 16
+
+enum { PRED_EQ, PRED_NE, PRED_CHANGED, PRED_SCREEN };
+
+typedef struct {
+	unsigned count;
+	struct {
+		uint8_t op, mask, val;
+		uint16_t addr;
+		uint64_t hash;
+	} c[PRED_MAX];
+} pred_t;
+
+static void pred_parse(pred_t *p, const char *str) {
+	while (*str) {
+		char *end;
+		unsigned addr, mask = 0xff, val = 0, op;
+		if (p->count == PRED_MAX) ERR_EXIT("too many conditions\n");
+		if (!strncmp(str, "screen=", 7)) {
+			p->c[p->count].op = PRED_SCREEN;
+			p->c[p->count++].hash = strtoull(str + 7, &end, 16);
+		} else {
+			addr = strtoul(str, &end, 0);
+			if (*end == '&') mask = strtoul(end + 1, &end, 0);
+			if (addr > 0xffff || mask > 0xff) ERR_EXIT("bad condition\n");
+			if (*end == '~') op = PRED_CHANGED, end++;
+			else if (*end == '=') op = PRED_EQ, end++;
+			else if (end[0] == '!' && end[1] == '=') op = PRED_NE, end += 2;
+			else ERR_EXIT("bad condition\n");
+			if (op != PRED_CHANGED) val = strtoul(end, &end, 0);
+			p->c[p->count].op = op;
+			p->c[p->count].addr = addr;
+			p->c[p->count].mask = mask;
+			p->c[p->count++].val = val & mask;
+		}
+		if (*end && *end != ',') ERR_EXIT("bad condition\n");
+		str = *end ? end + 1 : end;
+	}
+}
+
+// remembers the values for the "changed" conditions
+static void pred_start(pred_t *p, cpu_state_t *s) {
+	unsigned i;
+	for (i = 0; i < p->count; i++)
+		if (p->c[i].op == PRED_CHANGED)
+			p->c[i].val = s->mem[p->c[i].addr] & p->c[i].mask;
+}
+
+static int pred_check(pred_t *p, sysctx_t *sys, cpu_state_t *s) {
+	unsigned i;
+	if (!p->count) return 0;
+	for (i = 0; i < p->count; i++) {
+		unsigned a = s->mem[p->c[i].addr] & p->c[i].mask;
+		switch (p->c[i].op) {
+		case PRED_EQ: if (a != p->c[i].val) return 0; break;
+		case PRED_NE: case PRED_CHANGED: if (a == p->c[i].val) return 0; break;
+		case PRED_SCREEN: if (screen_hash(sys) != p->c[i].hash) return 0; break;
+		}
+	}
+	return 1;
+}
+
+/* Replays: the start state, then the keys at each change, */
+/* as (frame, keys) pairs. The input is only read between frames */
+/* and the game clock is virtual, so a replay is reproducible. */
+
+#define REPLAY_MAGIC 0x52505554 /* "TUPR" */
+#define REPLAY_KEYS (0xff | 1 << 17) /* buttons and reset */
+
+struct replay {
+	FILE *f;
+	uint32_t keys;
+	uint32_t *events;
+	unsigned count, pos;
+};
+
+static void replay_record(sysctx_t *sys, cpu_state_t *s, const char *fn) {
+	replay_t *r = calloc(1, sizeof(replay_t));
+	size_t n = state_size(sys, s);
+	uint8_t *buf = malloc(n);
+	uint32_t head[2] = { REPLAY_MAGIC, n };
+	if (!r || !buf) ERR_EXIT("malloc failed\n");
+	if (!(r->f = fopen(fn, "wb"))) ERR_EXIT("can't open replay file\n");
+	state_save(sys, s, buf);
+	fwrite(head, 1, sizeof(head), r->f);
+	fwrite(buf, 1, n, r->f);
+	free(buf);
+	r->keys = sys->keys & REPLAY_KEYS;
+	sys->replay = r;
+	sys->frame_input = 1;
+}
+
+static void replay_play(sysctx_t *sys, cpu_state_t *s, const char *fn) {
+	replay_t *r = calloc(1, sizeof(replay_t));
+	size_t size, n = state_size(sys, s);
+	uint8_t *buf = loadfile(fn, &size, 1 << 30);
+	uint32_t head[2];
+	if (!r) ERR_EXIT("malloc failed\n");
+	if (!buf) ERR_EXIT("can't load replay file\n");
+	if (size >= sizeof(head)) memcpy(head, buf, sizeof(head));
+	if (size < sizeof(head) + n || head[0] != REPLAY_MAGIC || head[1] != n ||
+			!state_load(sys, s, buf + sizeof(head)))
+		ERR_EXIT("replay doesn't match this ROM\n");
+	r->count = (size - sizeof(head) - n) / 8;
+	r->events = malloc(r->count * 8 + 1);
+	if (!r->events) ERR_EXIT("malloc failed\n");
+	memcpy(r->events, buf + sizeof(head) + n, r->count * 8);
+	free(buf);
+	r->keys = sys->keys & 0xff;
+	sys->replay = r;
+	sys->frame_input = 1;
+}
+
+// after a state is loaded
+static void replay_seek(sysctx_t *sys) {
+	replay_t *r = sys->replay;
+	for (r->pos = 0; r->pos < r->count; r->pos++)
+		if (r->events[r->pos * 2] > sys->game.frame_count) break;
+	r->keys = sys->keys & 0xff;
+}
+
+// the frame of the last event
+static uint32_t replay_end(sysctx_t *sys) {
+	replay_t *r = sys->replay;
+	return r->count ? r->events[(r->count - 1) * 2] : 0;
+}
+
+static void replay_frame(sysctx_t *sys) {
+	replay_t *r = sys->replay;
+	uint32_t frame = sys->game.frame_count, k;
+	if (r->f) {
+		k = sys->keys & REPLAY_KEYS;
+		if (k != r->keys) {
+			uint32_t ev[2] = { frame, k };
+			fwrite(ev, 1, sizeof(ev), r->f);
+			r->keys = k;
+		}
+		return;
+	}
+	// the live input is back when the replay ends
+	if (r->pos == r->count) return;
+	for (; r->pos < r->count && r->events[r->pos * 2] <= frame; r->pos++) {
+		k = r->events[r->pos * 2 + 1];
+		sys->keys = (sys->keys & ~REPLAY_KEYS) | k;
+		r->keys = k & 0xff;
+	}
+	sys->keys = (sys->keys & ~0xff) | r->keys;
+}
+
+static void replay_close(sysctx_t *sys) {
+	replay_t *r = sys->replay;
+	sys->replay = NULL;
+	if (r->f && (ferror(r->f) | fclose(r->f)))
+		fprintf(stderr, "error writing replay file\n");
+	free(r->events);
+	free(r);
+}
+
+/* Finds the first frame where the predicate holds in a replay: */
+/* a fast pass checks it at snapshots taken every "interval" frames, */
+/* then the last interval is bisected, moving the snapshot forward. */
+
+static void bisect_frame(sysctx_t *sys, cpu_state_t *s) {
+	game_frame(sys, s);
+	if (sys->keys & 1 << 17) {
+		game_reset(sys, s);
+		game_init(sys, s);
+	}
+}
+
+static int run_bisect(sysctx_t *sys, cpu_state_t *s, pred_t *p, unsigned interval) {
+	game_state_t *g = &sys->game;
+	uint32_t end = sys->frame_limit ? sys->frame_limit : replay_end(sys) + 1;
+	uint32_t lo, hi, mid, checks = 0;
+	uint64_t time = sys_time_us(sys);
+	uint8_t *snap = malloc(state_size(sys, s));
+	if (!snap) ERR_EXIT("malloc failed\n");
+	sys->frame_limit = 0;
+
+	game_init(sys, s);
+	replay_frame(sys);
+	pred_start(p, s);
+	if (pred_check(p, sys, s)) {
+		printf("the predicate holds at the start (frame %u)\n", g->frame_count);
+		free(snap);
+		return 0;
+	}
+	state_save(sys, s, snap);
+	lo = g->frame_count;
+	for (;;) {
+		if (g->frame_count >= end) {
+			printf("the predicate doesn't hold up to frame %u\n", g->frame_count);
+			free(snap);
+			return 1;
+		}
+		bisect_frame(sys, s);
+		if (g->frame_count % interval && g->frame_count != end) continue;
+		checks++;
+		if (pred_check(p, sys, s)) break;
+		state_save(sys, s, snap);
+		lo = g->frame_count;
+	}
+	hi = g->frame_count;
+
+	// the snapshot is at "lo", where the predicate is false
+	state_load(sys, s, snap);
+	replay_seek(sys);
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		while (g->frame_count < mid) bisect_frame(sys, s);
+		checks++;
+		if (pred_check(p, sys, s)) {
+			hi = mid;
+			state_load(sys, s, snap);
+			replay_seek(sys);
+		} else {
+			lo = mid;
+			state_save(sys, s, snap);
+		}
+	}
+	while (g->frame_count < hi) bisect_frame(sys, s);
+	time = sys_time_us(sys) - time;
+	printf("the predicate holds after frame %u (screen=%016llx)\n",
+			hi, (unsigned long long)screen_hash(sys));
+	printf("checks: %u, time: %.3f s\n", checks, time * 1e-6);
+	free(snap);
+	return 0;
+}
+
+/* Boot cache: the state after the init call and the first frames */
+/* (the start animation), per ROM (with its save area) in a directory. */
+
+/* buttons, quit and reset don't belong to the boot state */
+#define BOOT_KEYS (0xff | 3 << 16)
+
+static void boot_cache(sysctx_t *sys, cpu_state_t *s, const char *dir, unsigned frames) {
+	char fn[4096], tmp[4200];
+	size_t size, n = state_size(sys, s);
+	uint8_t *buf, turbo = sys->turbo;
+	unsigned i, limit = sys->frame_limit;
+	uint64_t insn_count = sys->insn_count;
+	char *log_buf = sys->log_buf;
+	FILE *f;
+
+	snprintf(fn, sizeof(fn), "%s/%016llx-%u.boot", dir,
+			(unsigned long long)hash_mem(0, sys->rom, sys->rom_size), frames);
+	buf = loadfile(fn, &size, n);
+	if (buf && size == n && state_load(sys, s, buf)) {
+		free(buf);
+		sys->keys &= ~BOOT_KEYS;
+		return;
+	}
+	free(buf);
+
+	// the same frames as the cached run, without waiting or tracing
+	sys->turbo = 1;
+	sys->frame_limit = 0;
+	sys->log_buf = NULL;
+	game_init(sys, s);
+	for (i = 0; i < frames; i++) game_frame(sys, s);
+	sys->turbo = turbo;
+	sys->frame_limit = limit;
+	sys->log_buf = log_buf;
+	sys->insn_count = insn_count;
+	sys->keys &= ~BOOT_KEYS;
+	if (!(buf = malloc(n))) ERR_EXIT("malloc failed\n");
+	state_save(sys, s, buf);
+	// concurrent instances may write the same entry
+#ifndef _WIN32
+	snprintf(tmp, sizeof(tmp), "%s.%u", fn, (unsigned)getpid());
+#else
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+#endif
+	if ((f = fopen(tmp, "wb"))) {
+		int err = fwrite(buf, 1, n, f) != n;
+		if (fclose(f) || err || rename(tmp, fn)) remove(tmp);
+	}
+	free(buf);
+}
+
+/* RAM search: candidate locations in the RAM (0x80-0x87f) and the */
+/* flash save area, narrowed down by comparing successive snapshots. */
+/* A candidate is a 0xff byte in a mask, so a filter is one vector */
+/* compare and AND per 16 bytes. */
+
+#define SEARCH_RAM 0x800
+#define SEARCH_SIZE (SEARCH_RAM + 0x10000)
+
+enum {
+	SEARCH_EQ, SEARCH_NE, /* value */
+	SEARCH_CHANGED, SEARCH_UNCHANGED,
+	SEARCH_INC, SEARCH_DEC,
+	SEARCH_INC_BY, SEARCH_DEC_BY, /* value, modulo 256 */
+};
+
+typedef uint8_t vec_u8 __attribute__((vector_size(16)));
+
+typedef struct {
+	uint8_t prev[SEARCH_SIZE];
+	uint8_t cand[SEARCH_SIZE];
+} ram_search_t;
+
+static unsigned search_count(ram_search_t *rs) {
+	unsigned i, n = 0;
+	for (i = 0; i < SEARCH_SIZE; i += 8) {
+		uint64_t a; memcpy(&a, rs->cand + i, 8);
+		n += __builtin_popcountll(a & 0x0101010101010101ull);
+	}
+	return n;
+}
+
+static unsigned search_reset(ram_search_t *rs, sysctx_t *sys, cpu_state_t *s) {
+	memcpy(rs->prev, s->mem + 0x80, SEARCH_RAM);
+	memcpy(rs->prev + SEARCH_RAM, sys->rom + sys->save_offs, 0x10000);
+	memset(rs->cand, 0xff, SEARCH_SIZE);
+	return SEARCH_SIZE;
+}
+
+static void search_range(uint8_t *prev, uint8_t *cand, const uint8_t *cur,
+		unsigned n, unsigned op, uint8_t val) {
+	vec_u8 c, p, m, v = (vec_u8){ 0 } + val;
+	unsigned i;
+
+#define X(cond) \
+	for (i = 0; i < n; i += 16) { \
+		memcpy(&c, cur + i, 16); memcpy(&p, prev + i, 16); \
+		memcpy(&m, cand + i, 16); \
+		m &= (vec_u8)(cond); \
+		memcpy(cand + i, &m, 16); memcpy(prev + i, &c, 16); \
+	} break;
+
+	switch (op) {
+	case SEARCH_EQ: X(c == v)
+	case SEARCH_NE: X(c != v)
+	case SEARCH_CHANGED: X(c != p)
+	case SEARCH_UNCHANGED: X(c == p)
+	case SEARCH_INC: X(c > p)
+	case SEARCH_DEC: X(c < p)
+	case SEARCH_INC_BY: X((vec_u8)(c - p) == v)
+	case SEARCH_DEC_BY: X((vec_u8)(p - c) == v)
+	}
+#undef X
+}
+
+// the current values become the snapshot for the next filter
+static unsigned search_filter(ram_search_t *rs, sysctx_t *sys, cpu_state_t *s,
+		unsigned op, uint8_t val) {
+	search_range(rs->prev, rs->cand, s->mem + 0x80, SEARCH_RAM, op, val);
+	search_range(rs->prev + SEARCH_RAM, rs->cand + SEARCH_RAM,
+			sys->rom + sys->save_offs, 0x10000, op, val);
+	return search_count(rs);
+}
+
+// a location is the RAM address or 0x10000 + the offset in the save area
+static unsigned search_list(ram_search_t *rs, uint8_t *out, unsigned max) {
+	unsigned i, n = 0;
+	for (i = 0; i < SEARCH_SIZE && n < max; i += 8) {
+		uint64_t a; unsigned j;
+		memcpy(&a, rs->cand + i, 8);
+		if (!a) continue;
+		for (j = i; j < i + 8 && n < max; j++)
+			if (rs->cand[j]) {
+				uint32_t loc = j < SEARCH_RAM ? j + 0x80 : j - SEARCH_RAM + 0x10000;
+				loc |= (uint32_t)rs->prev[j] << 24;
+				memcpy(out + n++ * 4, &loc, 4);
+			}
+	}
+	return n;
+}
+
+#ifndef _WIN32
+/* Daemon mode: one process runs many headless instances, */
+/* controlled over a UNIX socket. All numbers are little-endian u32. */
+/* request: magic, size (of the rest), count, then "count" commands: */
+/*   cmd, id, arg0, arg1, len, followed by "len" bytes of data */
+/* response: magic, size, count, then the results: */
+/*   status, value, len, followed by "len" bytes of data */
+/* The commands of a request are run in order. */
+
+#define DAEMON_MAGIC 0x44505554 /* "TUPD" */
+#define DAEMON_MAX_REQ (64 << 20)
+#define DAEMON_MAX_CLIENTS 64
+
+enum {
+	DCMD_CREATE = 1, /* data: ROM path (optional), value: id */
+	DCMD_DESTROY,
+	DCMD_LOAD, /* data: ROM path, restarts the instance */
+	DCMD_STEP, /* arg0: frames, value: frames done */
+	DCMD_KEYS, /* arg0: buttons (left, middle, right, side left, side right) */
+	DCMD_SNAPSHOT, /* data: state */
+	DCMD_RESTORE, /* data: state */
+	DCMD_SCREEN, /* value: width | height << 16, data: palette indices */
+	DCMD_RAM, /* arg0: address, arg1: size, data: memory */
+	DCMD_SEARCH_RESET, /* value: candidates */
+	DCMD_SEARCH, /* arg0: filter, arg1: value, value: candidates */
+	DCMD_SEARCH_LIST, /* arg0: max count, value: candidates, */
+	                  /* data: location | value << 24 */
+};
+
+enum { DST_OK, DST_BAD_CMD, DST_BAD_ID, DST_ERROR };
+
+/* The decoded ROM is kept in a temporary file, each instance maps */
+/* it privately, so only the written flash pages are copied. */
+typedef struct daemon_rom {
+	struct daemon_rom *next;
+	char *path;
+	int fd;
+	size_t size;
+	uint8_t key;
+	uint8_t *boot; /* state after the init call */
+} daemon_rom_t;
+
+typedef struct {
+	sysctx_t sys;
+	cpu_state_t cpu;
+	unsigned id;
+	int broken;
+	ram_search_t *search;
+} daemon_inst_t;
+
+typedef struct {
+	run_emu_t *run_emu;
+	daemon_rom_t *roms;
+	daemon_inst_t **inst;
+	unsigned inst_count;
+	uint8_t *load_buf, *out;
+	size_t out_size, out_max;
+} daemon_t;
+
+static void* daemon_out(daemon_t *d, const void *p, size_t n) {
+	uint8_t *ret;
+	if (d->out_max - d->out_size < n) {
+		d->out_max = d->out_max * 2 + n;
+		d->out = realloc(d->out, d->out_max);
+		if (!d->out) ERR_EXIT("malloc failed\n");
+	}
+	ret = d->out + d->out_size;
+	if (p) memcpy(ret, p, n);
+	d->out_size += n;
+	return ret;
+}
+
+static daemon_rom_t* daemon_rom(daemon_t *d, const char *path) {
+	daemon_rom_t *r;
+	sysctx_t sys;
+	size_t size;
+	FILE *f;
+	int fd = -1;
+
+	for (r = d->roms; r; r = r->next)
+		if (!strcmp(r->path, path)) return r;
+	memset(&sys, 0, sizeof(sys));
+	d->load_buf = sys.rom = loadfile(path, &size, 8 << 20);
+	if (!sys.rom) ERR_EXIT("can't load ROM file\n");
+	sys_model(&sys, size);
+	sys.rom_size = size;
+	check_rom(&sys);
+	f = tmpfile();
+	if (f) {
+		if (fwrite(sys.rom, 1, size, f) == size && !fflush(f))
+			fd = dup(fileno(f));
+		fclose(f);
+	}
+	free(sys.rom);
+	d->load_buf = NULL;
+	if (fd < 0) ERR_EXIT("can't create ROM image\n");
+	r = calloc(1, sizeof(*r));
+	if (!r || !(r->path = strdup(path))) ERR_EXIT("malloc failed\n");
+	r->fd = fd;
+	r->size = size;
+	r->key = sys.rom_key;
+	r->next = d->roms;
+	d->roms = r;
+	return r;
+}
+
+static void daemon_unload(daemon_inst_t *inst) {
+	sysctx_t *sys = &inst->sys;
+	sys_close(sys);
+	if (sys->rom) munmap(sys->rom, sys->rom_size);
+	sys->rom = NULL;
+}
+
+static void daemon_load(daemon_t *d, daemon_inst_t *inst, const char *path) {
+	daemon_rom_t *r = daemon_rom(d, path);
+	sysctx_t *sys = &inst->sys;
+	void *p;
+
+	daemon_unload(inst);
+	memset(sys, 0, sizeof(*sys));
+	memset(&inst->cpu, 0, sizeof(inst->cpu));
+	inst->broken = 1;
+	p = mmap(NULL, r->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, r->fd, 0);
+	if (p == MAP_FAILED) ERR_EXIT("mmap failed\n");
+	sys->rom = p;
+	sys->rom_size = r->size;
+	sys->save_offs = r->size - 0x10000;
+	sys->rom_key = r->key;
+	sys_model(sys, r->size);
+	sys->run_emu = d->run_emu;
+	sys->tick_limit = 1000000;
+	sys->headless = 1;
+	sys->turbo = 1;
+	sys->zoom = 1;
+	sys_init(sys);
+	if (r->boot) state_load(sys, &inst->cpu, r->boot);
+	game_init(sys, &inst->cpu);
+	if (!r->boot && (r->boot = malloc(state_size(sys, &inst->cpu))))
+		state_save(sys, &inst->cpu, r->boot);
+	sys->game.disp_time = sys_time_ms(sys);
+	inst->broken = 0;
+}
+
+static unsigned daemon_step(daemon_inst_t *inst, unsigned n) {
+	sysctx_t *sys = &inst->sys;
+	unsigned i;
+	for (i = 0; i < n; i++) {
+		if (sys->keys & 1 << 16) break;
+		if (sys->keys & 1 << 17) {
+			game_reset(sys, &inst->cpu);
+			game_init(sys, &inst->cpu);
+			sys->game.disp_time = sys_time_ms(sys);
+		}
+		game_frame(sys, &inst->cpu);
+	}
+	return i;
+}
+
+static int daemon_exec(daemon_t *d, daemon_inst_t * volatile *pinst,
+		const uint32_t *h, const uint8_t *data, uint32_t *value) {
+	daemon_inst_t *inst = *pinst;
+	sysctx_t *sys = inst ? &inst->sys : NULL;
+	unsigned i, len = h[4];
+	char path[4096];
+
+	if (h[0] == DCMD_CREATE || h[0] == DCMD_LOAD) {
+		if (len >= sizeof(path)) return DST_BAD_CMD;
+		memcpy(path, data, len);
+		path[len] = 0;
+	}
+	switch (h[0]) {
+	case DCMD_CREATE:
+		for (i = 0; i < d->inst_count; i++) if (!d->inst[i]) break;
+		if (i == d->inst_count) {
+			d->inst = realloc(d->inst, ++d->inst_count * sizeof(*d->inst));
+			if (!d->inst) ERR_EXIT("malloc failed\n");
+		}
+		*pinst = inst = calloc(1, sizeof(*inst));
+		if (!inst) ERR_EXIT("malloc failed\n");
+		d->inst[i] = inst;
+		*value = inst->id = i + 1;
+		inst->broken = 1;
+		if (len) daemon_load(d, inst, path);
+		return DST_OK;
+	case DCMD_DESTROY:
+		daemon_unload(inst);
+		d->inst[inst->id - 1] = NULL;
+		free(inst->search);
+		free(inst);
+		*pinst = NULL;
+		return DST_OK;
+	case DCMD_LOAD:
+		daemon_load(d, inst, path);
+		return DST_OK;
+	case DCMD_RESTORE:
+		if (!sys->rom) ERR_EXIT("no ROM loaded\n");
+		// the state is checked before anything is copied
+		if (len != state_size(sys, &inst->cpu) ||
+				!state_load(sys, &inst->cpu, (uint8_t*)data))
+			return DST_BAD_CMD;
+		inst->broken = 0;
+		return DST_OK;
+	}
+	if (inst->broken) ERR_EXIT("instance needs a ROM or a state\n");
+	switch (h[0]) {
+	case DCMD_STEP:
+		*value = daemon_step(inst, h[2]);
+		break;
+	case DCMD_KEYS:
+		sys->keys &= ~0x1ff;
+		for (i = 0; i < 5; i++)
+			if (h[2] >> i & 1) sys->keys |= 1 << sys->keymap[i];
+		break;
+	case DCMD_SNAPSHOT:
+		state_save(sys, &inst->cpu, daemon_out(d, NULL, state_size(sys, &inst->cpu)));
+		break;
+	case DCMD_SCREEN:
+		*value = SCREEN_W | sys->screen_h << 16;
+		daemon_out(d, sys->screen, SCREEN_W * sys->screen_h);
+		break;
+	case DCMD_RAM:
+		if (h[2] > 0x10000 || h[3] > 0x10000 - h[2]) return DST_BAD_CMD;
+		daemon_out(d, inst->cpu.mem + h[2], h[3]);
+		break;
+	case DCMD_SEARCH_RESET:
+		if (!inst->search && !(inst->search = malloc(sizeof(ram_search_t))))
+			ERR_EXIT("malloc failed\n");
+		*value = search_reset(inst->search, sys, &inst->cpu);
+		break;
+	case DCMD_SEARCH:
+		if (!inst->search || h[2] > SEARCH_DEC_BY) return DST_BAD_CMD;
+		*value = search_filter(inst->search, sys, &inst->cpu, h[2], h[3]);
+		break;
+	case DCMD_SEARCH_LIST:
+		if (!inst->search) return DST_BAD_CMD;
+		*value = search_count(inst->search);
+		i = h[2] < *value ? h[2] : *value;
+		search_list(inst->search, daemon_out(d, NULL, i * 4), i);
+		break;
+	default:
+		return DST_BAD_CMD;
+	}
+	return DST_OK;
+}
+
+static void daemon_cmd(daemon_t *d, const uint32_t *h, const uint8_t *data) {
+	size_t pos = d->out_size;
+	uint32_t res[3] = { DST_OK, 0, 0 };
+	daemon_inst_t * volatile inst = NULL;
+	jmp_buf jb;
+
+	daemon_out(d, res, sizeof(res));
+	if (h[0] != DCMD_CREATE) {
+		if (h[1] - 1 >= d->inst_count || !d->inst[h[1] - 1]) {
+			res[0] = DST_BAD_ID;
+			memcpy(d->out + pos, res, sizeof(res));
 			return;
 		}
+		inst = d->inst[h[1] - 1];
+	}
+	if (setjmp(jb)) {
+		// the instance stays broken until it's loaded or restored
+		d->out_size = pos + sizeof(res);
+		free(d->load_buf);
+		d->load_buf = NULL;
+		res[0] = DST_ERROR;
+		res[1] = 0;
+		if (inst) {
+			inst->broken = 1;
+			if (h[0] == DCMD_CREATE) {
+				daemon_unload(inst);
+				d->inst[inst->id - 1] = NULL;
+				free(inst);
+			}
+		}
+		daemon_out(d, err_msg, strlen(err_msg));
+	} else {
+		err_jmp = &jb;
+		res[0] = daemon_exec(d, &inst, h, data, &res[1]);
 	}
+	err_jmp = NULL;
+	res[2] = d->out_size - pos - sizeof(res);
+	memcpy(d->out + pos, res, sizeof(res));
 }
 
-#include <time.h>
+static int daemon_io(int fd, void *buf, size_t n, int wr) {
+	uint8_t *p = buf;
+	while (n) {
+		ssize_t k = wr ? write(fd, p, n) : read(fd, p, n);
+		if (k <= 0) return -1;
+		p += k; n -= k;
+	}
+	return 0;
+}
 
-static void update_time(sysctx_t *sys, cpu_state_t *s) {
-	time_t t = time(NULL);
-	struct tm *tm = localtime(&t);
-	// ToumaPet or QPet 2
-	int off = sys->model >= 550 ? 0x1df : 0x1dc;
-	s->mem[off] = tm->tm_year % 100;
-	s->mem[off + 1] = tm->tm_mon;
-	s->mem[off + 2] = tm->tm_mday - 1;
-	s->mem[off + 3] = tm->tm_hour;
-	s->mem[off + 4] = tm->tm_min;
-	s->mem[off + 5] = tm->tm_sec * 2;
+/* Reads one request and sends the response, -1 closes the connection. */
+static int daemon_client(daemon_t *d, int fd) {
+	uint32_t head[3], h[5], i;
+	uint8_t *buf; size_t pos = 0;
+
+	if (daemon_io(fd, head, sizeof(head), 0)) return -1;
+	if (head[0] != DAEMON_MAGIC || head[1] > DAEMON_MAX_REQ) return -1;
+	buf = malloc(head[1] + 1);
+	if (!buf) ERR_EXIT("malloc failed\n");
+	if (daemon_io(fd, buf, head[1], 0)) { free(buf); return -1; }
+	d->out_size = 0;
+	daemon_out(d, NULL, sizeof(head));
+	for (i = 0; i < head[2]; i++) {
+		if (head[1] - pos < sizeof(h)) break;
+		memcpy(h, buf + pos, sizeof(h));
+		pos += sizeof(h);
+		if (head[1] - pos < h[4]) break;
+		daemon_cmd(d, h, buf + pos);
+		pos += h[4];
+	}
+	free(buf);
+	if (i != head[2]) return -1;
+	head[1] = d->out_size - sizeof(head);
+	memcpy(d->out, head, sizeof(head));
+	return daemon_io(fd, d->out, d->out_size, 1);
 }
 
-static void run_game(sysctx_t *sys, cpu_state_t *s) {
-	unsigned disp_time, frames, fps = 30;
-	unsigned last_time, frame_skip = 0;
-reset:
-	frames = 0;
-	if (!sys->init_done) {
-		sys->init_done = 1;
-		s->mem[0xa3] |= 1; // to play start animation
-#if 0 // Opens at boot when the left and right buttons are pressed.
-		s->mem[0x93] |= 1; // to open test menu
+static int run_daemon(const char *path, run_emu_t *run_emu) {
+	struct sockaddr_un addr;
+	struct pollfd fds[DAEMON_MAX_CLIENTS + 1];
+	unsigned i, nfds = 1;
+	daemon_t d;
+	int fd;
+
+	memset(&d, 0, sizeof(d));
+	d.run_emu = run_emu;
+	signal(SIGPIPE, SIG_IGN);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path)) ERR_EXIT("socket path is too long\n");
+	strcpy(addr.sun_path, path);
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) ERR_EXIT("socket failed\n");
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) || listen(fd, 16))
+		ERR_EXIT("can't listen on %s\n", path);
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+
+	// the requests are served one at a time
+	for (;;) {
+		if (poll(fds, nfds, -1) < 0) continue;
+		if (fds[0].revents & POLLIN) {
+			fd = accept(fds[0].fd, NULL, NULL);
+			if (fd >= 0 && nfds > DAEMON_MAX_CLIENTS) close(fd);
+			else if (fd >= 0) {
+				fds[nfds].fd = fd;
+				fds[nfds].events = POLLIN;
+				fds[nfds++].revents = 0;
+			}
+		}
+		for (i = nfds; --i >= 1; ) {
+			if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+			if (daemon_client(&d, fds[i].fd)) {
+				close(fds[i].fd);
+				fds[i] = fds[--nfds];
+			}
+		}
+	}
+	return 0;
+}
 #endif
-		s->mem[0x99] = sys->rom_key;
 
-		sys->frame_depth = 0;
-		s->sp = 0x7f; // guess
-		s->pc = 0x60de;
-		WRITE24(s->mem + 0x80, READ16(sys->rom + 3));
-		WRITE16(s->mem + 0x83, READ16(sys->rom + 3 + 2));
-		run_emu(sys, s);
+#ifndef _WIN32
+/* Monitor: one window with a grid of the running instances that */
+/* publish their screen (--shm-screen). Changed screens are copied */
+/* first, then converted in one pass and presented once. */
+
+#define MONITOR_FPS 30
+
+typedef struct {
+	shm_screen_t *m;
+	unsigned pid, seq, screen_h, clear;
+	uint8_t screen[SCREEN_W * SCREEN_H_MAX];
+} monitor_tile_t;
+
+static shm_screen_t* monitor_open(const char *name) {
+	shm_screen_t *m;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) return NULL;
+	if (lseek(fd, 0, SEEK_END) < (off_t)sizeof(shm_screen_t)) {
+		close(fd); return NULL;
+	}
+	m = mmap(NULL, sizeof(shm_screen_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) return NULL;
+	if (__atomic_load_n(&m->magic, __ATOMIC_ACQUIRE) != SHM_SCREEN_MAGIC ||
+			m->version != SHM_SCREEN_VERSION || m->size != sizeof(shm_screen_t)) {
+		munmap(m, sizeof(shm_screen_t));
+		return NULL;
 	}
+	return m;
+}
 
-	last_time = sys_time_ms(sys);
+// zombies are dead too, their parent may never reap them
+static int monitor_alive(unsigned pid) {
+	char name[64], state = 0;
+	FILE *f;
+	if (kill(pid, 0) && errno == ESRCH) return 0;
+	snprintf(name, sizeof(name), "/proc/%u/stat", pid);
+	if ((f = fopen(name, "r"))) {
+		if (fscanf(f, "%*d (%*[^)]) %c", &state) != 1) state = 0;
+		fclose(f);
+	}
+	return state != 'Z';
+}
 
-#ifndef START_DELAY
-// to be able to open the test menu
-#define START_DELAY 500
-#endif
+static void monitor_scan(monitor_tile_t *tiles, unsigned n) {
+	DIR *dir; struct dirent *e;
+	unsigned i, j, pid;
+	char name[300];
+
+	// drop the exited instances
+	for (i = 0; i < n; i++) {
+		monitor_tile_t *t = &tiles[i];
+		if (!t->m || monitor_alive(t->pid)) continue;
+		munmap(t->m, sizeof(shm_screen_t));
+		t->m = NULL;
+		t->clear = 1;
+	}
 
-	sys_update(sys);
-#if START_DELAY
-	sys_sleep(START_DELAY);
-	game_event(sys);
-#endif
+	dir = opendir("/dev/shm");
+	if (!dir) return;
+	while ((e = readdir(dir))) {
+		int len = 0;
+		if (sscanf(e->d_name, "toumapet-screen.%u%n", &pid, &len) != 1 ||
+				e->d_name[len]) continue;
+		for (i = n, j = 0; j < n; j++) {
+			if (tiles[j].m && tiles[j].pid == pid) break;
+			if (!tiles[j].m && i == n) i = j;
+		}
+		if (j < n) continue;
+		if (i == n) break;
+		// left behind by an instance killed by a signal
+		if (!monitor_alive(pid)) continue;
+		snprintf(name, sizeof(name), "/%s", e->d_name);
+		if (!(tiles[i].m = monitor_open(name))) continue;
+		tiles[i].pid = pid;
+		tiles[i].seq = 1; // never a complete frame
+		tiles[i].clear = 1;
+	}
+	closedir(dir);
+}
 
-	disp_time = sys_time_ms(sys);
-	while (!(sys->keys & 3 << 16)) {
-		int ev;
-		unsigned a, cur_time;
+static int run_monitor(unsigned n, unsigned zoom) {
+	window_t win;
+	uint32_t pal[256];
+	monitor_tile_t *tiles;
+	unsigned i, y, cols, rows, st, frame;
+	unsigned tw = SCREEN_W * zoom, th = SCREEN_H_MAX * zoom;
+	const char *err;
+
+	for (cols = 1; cols * cols < n; cols++);
+	rows = (n + cols - 1) / cols;
+	tiles = calloc(n, sizeof(monitor_tile_t));
+	if (!tiles) ERR_EXIT("malloc failed\n");
+	err = window_init(&win, "ToumaPet monitor", cols * tw, rows * th);
+	if (err) ERR_EXIT("%s\n", err);
+	make_pal(pal, win.red);
+	st = win.stride >> 2;
+
+	for (frame = 0;; frame++) {
+		int ev, key, upd = 0;
+		if (frame % MONITOR_FPS == 0) monitor_scan(tiles, n);
+
+		for (i = 0; i < n; i++) {
+			monitor_tile_t *t = &tiles[i];
+			shm_screen_t *m = t->m;
+			unsigned seq, h;
+			if (!m) continue;
+			seq = __atomic_load_n(&m->seq, __ATOMIC_ACQUIRE);
+			// unchanged or being written
+			if (seq == t->seq || seq & 1) continue;
+			h = m->screen_h;
+			if (h > SCREEN_H_MAX) h = SCREEN_H_MAX;
+			memcpy(t->screen, m->screen, SCREEN_W * h);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&m->seq, __ATOMIC_RELAXED) != seq) continue;
+			t->seq = seq;
+			t->screen_h = h;
+		}
 
-		if (!(s->mem[0x93] & 1 << 4)) {
-			int i;
-			for (i = 0; i < 10; i++) {
-				a = s->mem[0x183 + i];
-				if (a) s->mem[0x183 + i] = a - 1;
+		for (i = 0; i < n; i++) {
+			monitor_tile_t *t = &tiles[i];
+			uint32_t *d = (uint32_t*)win.imagedata + i / cols * th * st + i % cols * tw;
+			if (t->clear) {
+				for (y = 0; y < th; y++) memset(d + y * st, 0, tw * 4);
+				t->clear = 0; upd = 1;
 			}
+			if (!t->m || !t->screen_h) continue;
+			screen_conv(pal, t->screen, t->screen_h, d, st, zoom);
+			t->screen_h = 0; upd = 1;
 		}
+		if (upd) window_update(&win);
+
+		while ((ev = window_event(&win, &key)) != EVENT_EMPTY)
+			if (ev == EVENT_QUIT || (ev == EVENT_KEY_PRESS && key == SYSKEY_ESCAPE)) {
+				window_close(&win);
+				for (i = 0; i < n; i++)
+					if (tiles[i].m) munmap(tiles[i].m, sizeof(shm_screen_t));
+				free(tiles);
+				return 0;
+			}
+		sys_sleep(1000 / MONITOR_FPS);
+	}
+}
+#endif
 
-		a = s->mem[0xaf];
-		if (a & 0x3f) s->mem[0xaf] = a - 1;
+#ifndef _WIN32
+/* Explores input sequences from a common state: each sequence runs */
+/* in a forked clone, so the ROM and the untouched pages are shared. */
 
-		// decrease idle timer
-		a = READ16(s->mem + 0x181);
-		//if (a) WRITE16(s->mem + 0x181, a < 30 ? 0 : a - 30);
-		if (a) WRITE16(s->mem + 0x181, a - 1);
+typedef struct {
+	unsigned depth, step, start, jobs;
+	const char *keys;
+	pred_t goal;
+} explore_opts_t;
 
-		a = sys_time_ms(sys) - last_time;
-		if (a > 500) {
-			last_time += 500;
-			s->mem[0xaf] |= 1 << 7;
-		}
+typedef struct {
+	uint32_t index;
+	int32_t goal; /* steps to reach the goal, or -1 */
+	uint64_t hash;
+	char err[80];
+} explore_res_t;
+
+/* Duplicates the running instance, returns 0 in the clone. */
+/* The clone must not touch the outputs of the parent. */
+static pid_t sys_clone(sysctx_t *sys) {
+	pid_t pid;
+	fflush(stdout); fflush(stderr);
+	pid = fork();
+	if (pid) return pid;
+	sys->prof = NULL; sys->timeline = NULL;
+	sys->metrics = NULL; sys->shm_screen = NULL;
+	sys->video = NULL; sys->vpipe = NULL;
+	sys->log_fn = NULL;
+	glob_sys = NULL;
+	return 0;
+}
 
-		if (sys->keys & 1 << 19) { /* WAI */
-			sys->keys &= ~(1 << 19);
-		} else {
-			sys->pixels_count = 0;
-			sys->frame_depth = 0;
-			s->sp = 0x7f; // guess
-			s->pc = 0x60de;
-			WRITE24(s->mem + 0x80, READ16(sys->rom + 0x1b));
-			WRITE16(s->mem + 0x83, READ16(sys->rom + 0x1b + 2));
-		}
-		if (frame_skip) frame_skip--;
-		else {
-			run_emu(sys, s);
-			if (sys->frame_depth == 0) {
-				/* Mini-games run too fast, because the real CPU */
-				/* can't compute one frame in time. */
-				/* This is a heuristic to solve this. */
-				frame_skip = (sys->pixels_count > 20000) + (sys->pixels_count > 40000);
-			}
-			if (sys->keys & 1 << 20) { // clean screen
-				sys->keys &= ~(1 << 20);
-				memset(sys->screen, 0, sizeof(sys->screen));
+// the key for step i of the sequence
+static const char* explore_seq(explore_opts_t *o, uint32_t index, unsigned i) {
+	unsigned n = strlen(o->keys);
+	while (++i < o->depth) index /= n;
+	return o->keys + index % n;
+}
+
+static void explore_child(sysctx_t *sys, cpu_state_t *s, explore_opts_t *o,
+		uint32_t index, int best, int fd) {
+	explore_res_t res;
+	jmp_buf jmp;
+	unsigned i, j, k;
+	memset(&res, 0, sizeof(res));
+	res.index = index;
+	res.goal = -1;
+	err_jmp = &jmp;
+	if (!setjmp(jmp)) {
+		for (i = 0; i < o->depth && (best < 0 || (int)i < best); i++) {
+			unsigned key = 0;
+			const char *p = strchr("asdqe", *explore_seq(o, index, i));
+			if (p) key = 1 << sys->keymap[p - "asdqe"];
+			// the key is held for the first half of the step
+			for (j = 0; j < o->step; j++) {
+				sys->keys = (sys->keys & ~0xff) | (j < (o->step + 1) / 2 ? key : 0);
+				game_frame(sys, s);
 			}
+			if (pred_check(&o->goal, sys, s)) { res.goal = i + 1; break; }
 		}
+		res.hash = hash_mem(hash_mem(0, s->mem, sizeof(s->mem)),
+				sys->screen, SCREEN_W * sys->screen_h);
+	} else {
+		memcpy(res.err, err_msg, sizeof(res.err) - 1);
+		k = strlen(res.err);
+		if (k && res.err[k - 1] == '\n') res.err[k - 1] = 0;
+	}
+	// smaller than PIPE_BUF, so the results don't interleave
+	if (write(fd, &res, sizeof(res)) != sizeof(res)) _exit(1);
+	_exit(0);
+}
 
-		sys_update(sys);
-#if 0
-		sys_sleep(1000 / fps);
-#else
-		cur_time = sys_time_ms(sys);
-		if (++frames >= fps)
-			disp_time += 1000, frames = 0;
-		a = frames * 1000 / fps + disp_time - cur_time;
-		if ((int)a < 0) disp_time = cur_time, frames = 0;
-		else sys_sleep(a);
-#endif
+static void explore_print(explore_opts_t *o, uint32_t index, unsigned steps) {
+	unsigned i;
+	for (i = 0; i < steps; i++)
+		printf(" %c", *explore_seq(o, index, i));
+	printf("\n");
+}
 
-		game_event(sys);
-	}
-	if (!(sys->keys & 1 << 16)) {
-		sys->keys &= 0xff;
-		sys->init_done = 0;
-		memset(s, 0, sizeof(*s));
-		goto reset;
-	}
+static int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
 }
 
-static void check_rom(sysctx_t *sys) {
-	unsigned rom_size = sys->rom_size;
-	unsigned res_offs;
-	unsigned i, key, moffs = 0x23;
-	const char *magic = "tony";
-	if (rom_size < 0x10000)
-		ERR_EXIT("ROM is too small\n");
-	sys->rom_key = key = sys->rom[moffs] ^ magic[0];
-	for (i = 1; i < 4; i++) {
-		if ((sys->rom[moffs + i] ^ key) != (unsigned)magic[i])
-			ERR_EXIT("ROM magic doesn't match\n");
+static int run_explore(sysctx_t *sys, cpu_state_t *s, explore_opts_t *o) {
+	game_state_t *g = &sys->game;
+	unsigned i, n = strlen(o->keys), total = 1, next = 0, done = 0, running = 0;
+	unsigned errors = 0, distinct = 0;
+	int best = -1, fds[2];
+	uint32_t best_index = 0;
+	uint64_t time, *hashes;
+	pid_t *pids;
+	uint32_t *pid_index, index = 0;
+	explore_res_t res;
+
+	for (i = 0; i < o->depth; i++) {
+		if (total > (1u << 24) / n) ERR_EXIT("too many sequences\n");
+		total *= n;
+	}
+	hashes = malloc(total * sizeof(uint64_t));
+	pids = malloc(o->jobs * sizeof(pid_t));
+	pid_index = malloc(o->jobs * sizeof(uint32_t));
+	if (!hashes || !pids || !pid_index) ERR_EXIT("malloc failed\n");
+	if (pipe(fds)) ERR_EXIT("pipe failed\n");
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	game_init(sys, s);
+	g->disp_time = sys_time_ms(sys);
+	for (i = 0; i < o->start; i++) game_frame(sys, s);
+	pred_start(&o->goal, s);
+	if (pred_check(&o->goal, sys, s)) {
+		printf("goal reached at the start\n");
+		return 0;
 	}
-	if (key)
-	for (i = 0; i < rom_size; i++) sys->rom[i] ^= key;
-	res_offs = READ24(sys->rom);
-	if (rom_size < res_offs)
-		ERR_EXIT("bad resources offset\n");
-}
 
-static void xor_save(sysctx_t *sys) {
-	unsigned i, key = sys->rom_key;
-	if (key)
-	for (i = sys->save_offs; i < sys->rom_size; i++)
-		sys->rom[i] ^= key;
+	time = sys_time_us(sys);
+	while (done < total) {
+		int st;
+		pid_t pid;
+		while (running < o->jobs && next < total) {
+			pid = sys_clone(sys);
+			if (!pid) explore_child(sys, s, o, next, best, fds[1]);
+			if (pid < 0) ERR_EXIT("fork failed\n");
+			pid_index[running] = next++;
+			pids[running++] = pid;
+		}
+		pid = waitpid(-1, &st, 0);
+		if (pid < 0) ERR_EXIT("waitpid failed\n");
+		for (i = 0; i < running; i++)
+			if (pids[i] == pid) {
+				index = pid_index[i];
+				pids[i] = pids[--running];
+				pid_index[i] = pid_index[running];
+				break;
+			}
+		if (!WIFEXITED(st) || WEXITSTATUS(st)) {
+			if (errors++ < 10) {
+				printf("error: clone died with status 0x%x:", st);
+				explore_print(o, index, o->depth);
+			}
+			done++;
+		}
+		while (read(fds[0], &res, sizeof(res)) == sizeof(res)) {
+			done++;
+			if (res.err[0]) {
+				if (errors++ < 10) {
+					printf("error: %s:", res.err);
+					explore_print(o, res.index, o->depth);
+				}
+				continue;
+			}
+			hashes[distinct++] = res.hash;
+			if (res.goal >= 0 && (best < 0 || res.goal < best ||
+					(res.goal == best && res.index < best_index)))
+				best = res.goal, best_index = res.index;
+		}
+	}
+	while (running) if (waitpid(pids[--running], NULL, 0) < 0) break;
+	time = sys_time_us(sys) - time;
+
+	qsort(hashes, distinct, sizeof(uint64_t), cmp_u64);
+	for (i = n = 0; i < distinct; i++)
+		if (!i || hashes[i] != hashes[i - 1]) n++;
+	printf("sequences: %u (depth %u, %u frames per step), time: %.3f s, clones/s: %.0f\n",
+			total, o->depth, o->step, time * 1e-6, total / (time * 1e-6));
+	// with a goal the clones stop at different depths
+	if (!o->goal.count) printf("distinct end states: %u, errors: %u\n", n, errors);
+	else {
+		printf("errors: %u\n", errors);
+		if (best < 0) printf("goal not reached\n");
+		else {
+			printf("goal reached after %d steps (%u frames):", best, best * o->step);
+			explore_print(o, best_index, best);
+		}
+	}
+	free(hashes);
+	free(pids);
+	free(pid_index);
+	close(fds[0]); close(fds[1]);
+	return 0;
 }
+#endif
 
 int main(int argc, char **argv) {
 	const char *rom_fn = "toumapet.bin";
 	const char *save_fn = NULL;
-#if CPU_TRACE
 	const char *log_fn = NULL;
 	int log_size = 4 << 20;
-#endif
+	const char *emu_name = NULL;
+	const char *prof_fn = NULL;
+	const char *timeline_fn = NULL;
+	unsigned long long tick_limit = 0;
 	uint8_t *rom; size_t rom_size;
 	cpu_state_t cpu;
 	sysctx_t sys;
-	int zoom = 3, upd_time = 0;
+	const char *cover_fn = NULL;
+	const char *lockstep_ref = NULL;
+	raw_opts_t raw = { NULL, 0, -1, -1, -1, 0 };
+	int i, zoom = 3, upd_time = 0, flash_trace = 0, metrics = 0, shm_screen = 0;
+	int headless = 0, turbo = 0, bench = 0, print_insns;
+	unsigned frame_limit = 0, monitor = 0;
+	const char *daemon_path = NULL;
+	const char *video_fn = NULL;
+	const char *vpipe_fmt = "y4m";
+	const char *record_fn = NULL, *replay_fn = NULL;
+	pred_t bisect = { 0 };
+	unsigned bisect_interval = 1000;
+	const char *boot_dir = NULL;
+	unsigned boot_frames = 0;
+	int vpipe_fd = -1, vpipe_zoom = 1;
+#ifndef _WIN32
+	explore_opts_t explore = { 0 };
+#endif
 
+#ifndef _WIN32
+	explore.step = 10;
+	explore.keys = "-asdqe";
+#endif
 	while (argc > 1) {
 		if (!strcmp(argv[1], "--save")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
@@ -1622,7 +4143,6 @@ int main(int argc, char **argv) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			rom_fn = argv[2];
 			argc -= 2; argv += 2;
-#if CPU_TRACE
 		} else if (!strcmp(argv[1], "--log")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			log_fn = argv[2];
@@ -1632,12 +4152,162 @@ int main(int argc, char **argv) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			log_size = atoi(argv[2]);
 			argc -= 2; argv += 2;
-#endif
+		} else if (!strcmp(argv[1], "--emu")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			emu_name = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--tick-limit")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			tick_limit = strtoull(argv[2], NULL, 0);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--prof")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			prof_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--timeline")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			timeline_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--coverage")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			cover_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--metrics")) {
+			metrics = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--shm-screen")) {
+			shm_screen = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--record-video")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			video_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--video-pipe")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			vpipe_fd = atoi(argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--video-format")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			vpipe_fmt = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--video-zoom")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			vpipe_zoom = atoi(argv[2]);
+			if (vpipe_zoom < 1) vpipe_zoom = 1;
+			if (vpipe_zoom > 8) vpipe_zoom = 8;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--flash-trace")) {
+			flash_trace = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--lockstep")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			lockstep_ref = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--raw")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			raw.fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--raw-load")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			raw.load = strtol(argv[2], NULL, 0) & 0xffff;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--raw-start")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			raw.start = strtol(argv[2], NULL, 0) & 0xffff;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--raw-success")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			raw.success = strtol(argv[2], NULL, 0) & 0xffff;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--raw-check")) {
+			char *end;
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			raw.check_addr = strtol(argv[2], &end, 0) & 0xffff;
+			if (*end != '=') ERR_EXIT("bad option\n");
+			raw.check_val = strtol(end + 1, NULL, 0) & 0xff;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--headless")) {
+			headless = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--turbo")) {
+			turbo = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--bench")) {
+			bench = 1;
+			argc -= 1; argv += 1;
+		} else if (!strcmp(argv[1], "--frames")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			frame_limit = strtoul(argv[2], NULL, 0);
+			argc -= 2; argv += 2;
 		} else if (!strcmp(argv[1], "--zoom")) {
 			if (argc <= 2) ERR_EXIT("bad option\n");
 			zoom = atoi(argv[2]);
 			if (zoom < 1) zoom = 1;
-			if (zoom > 5) zoom = 5;
+			if (zoom > 8) zoom = 8;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--daemon")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			daemon_path = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--monitor")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			monitor = strtoul(argv[2], NULL, 0);
+			if (monitor < 1) monitor = 1;
+			if (monitor > 256) monitor = 256;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--explore")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			explore.depth = strtoul(argv[2], NULL, 0);
+			if (!explore.depth) ERR_EXIT("bad option\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--explore-step")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			explore.step = strtoul(argv[2], NULL, 0);
+			if (!explore.step) explore.step = 1;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--explore-start")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			explore.start = strtoul(argv[2], NULL, 0);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--explore-keys")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			explore.keys = argv[2];
+			if (!*explore.keys || explore.keys[strspn(explore.keys, "-asdqe")])
+				ERR_EXIT("bad option\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--explore-goal")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			pred_parse(&explore.goal, argv[2]);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--explore-jobs")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			explore.jobs = strtoul(argv[2], NULL, 0);
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--record-replay")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			record_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--replay")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			replay_fn = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--bisect")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			pred_parse(&bisect, argv[2]);
+			if (!bisect.count) ERR_EXIT("bad option\n");
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--bisect-interval")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			bisect_interval = strtoul(argv[2], NULL, 0);
+			if (!bisect_interval) bisect_interval = 1;
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--boot-cache")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			boot_dir = argv[2];
+			argc -= 2; argv += 2;
+		} else if (!strcmp(argv[1], "--boot-frames")) {
+			if (argc <= 2) ERR_EXIT("bad option\n");
+			boot_frames = strtoul(argv[2], NULL, 0);
 			argc -= 2; argv += 2;
 		} else if (!strcmp(argv[1], "--update-time")) {
 			upd_time = 1;
@@ -1645,37 +4315,73 @@ int main(int argc, char **argv) {
 		} else ERR_EXIT("unknown option\n");
 	}
 
+	if (monitor) {
+#ifndef _WIN32
+		return run_monitor(monitor, zoom);
+#else
+		ERR_EXIT("the monitor isn't supported on this system\n");
+#endif
+	}
+
 	memset(&cpu, 0, sizeof(cpu));
 	memset(&sys, 0, sizeof(sys));
 
+	// the tracing and checking variants are only used when needed
+	// the count is only printed when asked for
+	print_insns = emu_name != NULL;
+	if (!emu_name) emu_name = raw.fn ? "raw" : log_fn ? "trace" : tick_limit ? "check" :
+			cover_fn ? "cover" : prof_fn || timeline_fn || metrics ? "count" : "fast";
+	for (i = 0; emu_variants[i].name; i++)
+		if (!strcmp(emu_variants[i].name, emu_name)) break;
+	if (!emu_variants[i].name) ERR_EXIT("unknown interpreter variant\n");
+	sys.run_emu = emu_variants[i].fn;
+	if ((sys.run_emu == run_emu_cover) != !!cover_fn)
+		ERR_EXIT("coverage needs the \"cover\" interpreter variant\n");
+	sys.tick_limit = tick_limit ? tick_limit : 1000000;
+	if ((sys.run_emu == run_emu_raw) != !!raw.fn)
+		ERR_EXIT("raw images need the \"raw\" interpreter variant\n");
+	if (raw.fn) {
+		if (!tick_limit) sys.tick_limit = ~0ull;
+		sys.headless = 1;
+		return run_raw(&sys, &cpu, &raw);
+	}
+	if (daemon_path) {
+#ifndef _WIN32
+		if (cover_fn || lockstep_ref || sys.run_emu == run_emu_trace)
+			ERR_EXIT("the daemon only runs the plain interpreter variants\n");
+		return run_daemon(daemon_path, sys.run_emu);
+#else
+		ERR_EXIT("the daemon mode isn't supported on this system\n");
+#endif
+	}
+#ifndef _WIN32
+	if (explore.depth) {
+		if (cover_fn || lockstep_ref || sys.run_emu == run_emu_trace)
+			ERR_EXIT("the explorer only runs the plain interpreter variants\n");
+		if (!explore.jobs) explore.jobs = sysconf(_SC_NPROCESSORS_ONLN);
+		if (explore.jobs < 1) explore.jobs = 1;
+		if (explore.jobs > 256) explore.jobs = 256;
+		// the clones never show the screen
+		headless = turbo = 1;
+		zoom = 1;
+		frame_limit = 0;
+	}
+#endif
+	if (record_fn && replay_fn) ERR_EXIT("can't record and replay at the same time\n");
+	if (bisect.count) {
+		if (!replay_fn) ERR_EXIT("bisection needs a replay\n");
+		headless = turbo = 1;
+		zoom = 1;
+	}
+	sys.flash_trace = flash_trace;
+	sys.headless = headless;
+	sys.turbo = turbo;
+	sys.bench = bench;
+	sys.frame_limit = frame_limit;
+
 	rom = loadfile(rom_fn, &rom_size, 8 << 20);
 	if (!rom) ERR_EXIT("can't load ROM file\n");
-	// a rough way to detect a model
-	if (rom_size == 2 << 20) {
-		sys.model = 2; // QPet 2
-		sys.screen_h = 128;
-		sys.keymap[0] = 4;
-		sys.keymap[1] = 5;
-		sys.keymap[2] = 6;
-		sys.keymap[3] = 8; // no button
-		sys.keymap[4] = 8; // no button
-	} else if (rom_size == 4 << 20) {
-		sys.model = 550;
-		sys.screen_h = 128;
-		sys.keymap[0] = 4;
-		sys.keymap[1] = 5;
-		sys.keymap[2] = 6;
-		sys.keymap[3] = 3;
-		sys.keymap[4] = 2;
-	} else if (rom_size == 8 << 20) {
-		sys.model = 560;
-		sys.screen_h = 160;
-		sys.keymap[0] = 2;
-		sys.keymap[1] = 3;
-		sys.keymap[2] = 4;
-		sys.keymap[3] = 5;
-		sys.keymap[4] = 6;
-	} else ERR_EXIT("unexpected ROM size\n");
+	sys_model(&sys, rom_size);
 
 	sys.save_offs = rom_size - 0x10000;
 	sys.rom = rom;
@@ -1683,7 +4389,6 @@ int main(int argc, char **argv) {
 	sys.zoom = zoom;
 	check_rom(&sys);
 
-#if CPU_TRACE
 	if (log_fn) {
 		if (log_size < 256) log_size = 256;
 		if (log_size > 1 << 30) log_size = 1 << 30;
@@ -1695,7 +4400,6 @@ int main(int argc, char **argv) {
 		if (!sys.log_buf) ERR_EXIT("malloc failed\n");
 		glob_sys = &sys;
 	}
-#endif
 
 	if (save_fn) {
 		unsigned n1, n2, n3;
@@ -1714,6 +4418,43 @@ int main(int argc, char **argv) {
 	}
 
 	sys_init(&sys);
+	// a save or the current time make a different start,
+	// the outputs are attached after the boot
+	if (boot_dir && !sys.init_done && !upd_time) {
+		boot_cache(&sys, &cpu, boot_dir, boot_frames);
+		// --frames counts the frames after the boot
+		if (sys.frame_limit) sys.frame_limit += sys.game.frame_count;
+	}
+	if (prof_fn) prof_init(&sys, prof_fn);
+	if (timeline_fn) {
+		timeline_init(&sys, timeline_fn);
+		glob_sys = &sys;
+	}
+	if (metrics) {
+		metrics_init(&sys);
+		glob_sys = &sys;
+	}
+	if (shm_screen) {
+		shm_screen_init(&sys);
+		glob_sys = &sys;
+	}
+	if (video_fn) {
+		video_init(&sys, video_fn);
+		glob_sys = &sys;
+	}
+	if (vpipe_fd >= 0) {
+#ifndef _WIN32
+		vpipe_init(&sys, vpipe_fd, vpipe_fmt, vpipe_zoom);
+		glob_sys = &sys;
+#else
+		ERR_EXIT("the video pipe isn't supported on this system\n");
+#endif
+	}
+	if (cover_fn) {
+		cover_init(&sys, cover_fn);
+		glob_sys = &sys;
+	}
+	if (lockstep_ref) lockstep_init(&sys, lockstep_ref, emu_name);
 
 	if (0) { // test keys
 		for (;;) {
@@ -1733,8 +4474,24 @@ int main(int argc, char **argv) {
 	}
 
 	if (upd_time) update_time(&sys, &cpu);
+	if (record_fn) replay_record(&sys, &cpu, record_fn);
+	if (replay_fn) replay_play(&sys, &cpu, replay_fn);
+	if (bisect.count) {
+		i = run_bisect(&sys, &cpu, &bisect, bisect_interval);
+		sys_close(&sys);
+		return i;
+	}
 
+#ifndef _WIN32
+	if (explore.depth) {
+		run_explore(&sys, &cpu, &explore);
+		sys_close(&sys);
+		return 0;
+	}
+#endif
 	run_game(&sys, &cpu);
+	if (print_insns && sys.insn_count)
+		printf("instructions: %llu\n", (unsigned long long)sys.insn_count);
 
 	if (save_fn) {
 		FILE *f = fopen(save_fn, "wb");
@@ -1748,5 +4505,6 @@ int main(int argc, char **argv) {
 	}
 
 	sys_close(&sys);
+	return 0;
 }
 